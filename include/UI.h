@@ -5,7 +5,7 @@
 class UI {
 
   public:
-    UI() : breakpoint(false), save_state(false), load_state(false), close(false) {
+    UI() : breakpoint(false), save_state(false), load_state(false), close(false), turbo(false), rewind(false), state_slot(1) {
     }
 
     virtual void update(unsigned tclock) = 0;
@@ -14,6 +14,10 @@ class UI {
     bool save_state;
     bool load_state;
     bool close;
+    bool turbo;  // fast-forward: no frame rate sync, audio decimated
+    bool rewind; // step backwards through the rewind history while held
+
+    unsigned state_slot; // savestate slot used by save_state and load_state
 
     virtual void read(std::istream &in)         = 0;
     virtual void write(std::ostream &out) const = 0;
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sound_defs.h"
+
+#define CAPTURE_BLOCK_FRAMES 44000u    // frames per background write, ~1 s of audio
+#define CAPTURE_FILE_BUFFER  (1 << 20) // stdio buffer per output file
+
+/*
+ * Streams generated samples to disk from a background thread.
+ * The stereo mix goes to the given file, per-channel stems (if enabled)
+ * to mono files named <file>_ch1 .. <file>_ch4. Files ending in .wav get
+ * a WAV header, anything else is written as raw signed 16-bit PCM.
+ */
+class AudioCapture {
+  public:
+    // throws std::runtime_error if an output file can't be opened
+    AudioCapture(const std::string &filename, bool channel_stems);
+    ~AudioCapture();
+
+    AudioCapture(AudioCapture const &)   = delete;
+    void operator=(AudioCapture const &) = delete;
+
+    // called once per generated sample, only copies into the current block
+    void push(sample_t left, sample_t right, const sample_t *channels) {
+        sample_t *frame = &fill_block[fill_frames * frame_width];
+        frame[0]        = left;
+        frame[1]        = right;
+        if (stems)
+            memcpy(frame + 2, channels, 4 * sizeof(sample_t));
+        if (++fill_frames == CAPTURE_BLOCK_FRAMES)
+            submit();
+    }
+
+    unsigned long frames_captured() const {
+        return total_frames;
+    }
+
+  private:
+    struct Track {
+        FILE *file;
+        unsigned channels;
+        unsigned long frames;
+        bool wav;
+    };
+
+    bool stems;
+    unsigned frame_width;
+
+    std::vector<sample_t> fill_block;
+    std::vector<sample_t> write_block;
+    std::vector<sample_t> scratch;
+    unsigned fill_frames;
+    unsigned write_frames;
+    unsigned long total_frames;
+
+    std::vector<Track> tracks;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool pending;
+    bool stopping;
+    std::thread writer;
+
+    void submit();
+
+    void writer_loop();
+
+    void write_block_to_disk();
+
+    static void write_header(Track &track);
+};
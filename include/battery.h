@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+struct MachineState;
+
+/*
+ * Battery-backed cartridge RAM. The cartridge region of a machine state (RAM
+ * banks and MBC3 clock registers) is mapped from a save file, so every write
+ * reaches the page cache directly: nothing has to be flushed while running and
+ * the save survives a crash of the emulator. A save file is locked by the
+ * instance using it, others fall back to unmapped memory.
+ */
+class BatterySave {
+  public:
+    // state block with cart_ram_size bytes mapped from filename, created or extended with zeros as needed.
+    // state is nullptr if the file can't be used.
+    BatterySave(const std::string &filename, unsigned cart_ram_size);
+    ~BatterySave();
+
+    BatterySave(BatterySave const &)    = delete;
+    void operator=(BatterySave const &) = delete;
+
+    MachineState *state;
+
+    // save file for a ROM: the ROM path with its extension replaced by .sav
+    static std::string filename_for(const std::string &romfile);
+
+  private:
+    int fd;
+    void *mapping;
+    size_t mapped_bytes;
+};
@@ -13,10 +13,11 @@
 
 class Buttons {
   public:
-    Buttons() : state(0) {
+    Buttons(uint8_t &StateRef) : state(StateRef) {
+        state = 0;
     }
 
-    uint8_t state;
+    uint8_t &state;
 
     uint8_t dpad_state() {
         return state & 0x0F;
@@ -1,30 +1,42 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include "rom_store.h"
+#include "state.h"
 
 using namespace std;
 
+#define CART_RTC_SIZE 256u // MBC3 clock registers, padded to a state page
+
 class Cart {
   public:
     enum mbc_type { NONE, MBC1, MBC2, MBC3, MBC5 };
     mbc_type bank_controller;
 
-    enum controller_mode { ROM_banking, RAM_banking }; // MBC1 mode switch
-    controller_mode mbc_mode;
+    using controller_mode = CartState::controller_mode; // MBC1 mode switch
+    controller_mode &mbc_mode;
 
-    uint8_t *ROM;
+    uint8_t *ROM; // read-only mapping from RomStore
     uint8_t *RAM;
 
-    uint8_t RTC_registers[5];
-    unsigned RTC_reg_select;
-    bool RTC_access;
+    // 8K RAM banks backed by RAM, possibly shared with a forked parent until written
+    vector<SharedRegion> RAM_BANKS;
+
+    uint8_t *RTC_registers; // after the RAM banks on MBC3 carts, nullptr otherwise
+    unsigned &RTC_reg_select;
+    bool &RTC_access;
 
-    unsigned rom_bank;
-    unsigned ram_bank;
+    unsigned &rom_bank;
+    unsigned &ram_bank;
 
     uint8_t *rom0Ptr(uint16_t addr) {
         assert(addr < 0x4000);
@@ -41,84 +53,174 @@ class Cart {
         if (RTC_access) {
             return &RTC_registers[RTC_reg_select];
         } else if (ram_banks) {
-            return &RAM[0x2000 * ram_bank + addr];
+            return &RAM_BANKS[ram_bank].data[addr];
         } else {
             return nullptr;
         }
     }
 
-    Cart(string &filename, bool print_to_stdout=false) : mbc_mode(controller_mode::ROM_banking), rom_bank(1), ram_bank(0) {
-
-        ifstream romfile(filename, ios::binary);
-        if (!romfile.good()) {
-            printf("could not open ROM file\n");
-            exit(1);
+    uint8_t *ramWritePtr(uint16_t addr) {
+        assert(addr < 0x2000);
+        if (RTC_access) {
+            mark_dirty(ram_size >> 8);
+            return &RTC_registers[RTC_reg_select];
+        } else if (ram_banks) {
+            mark_dirty((0x2000 * ram_bank + addr) >> 8);
+            return &RAM_BANKS[ram_bank].writable()[addr];
+        } else {
+            return nullptr;
         }
+    }
 
-        romfile.seekg(0, romfile.end);
-        rom_size = romfile.tellg();
+    const RomImage &rom_image() const {
+        return *rom_owner;
+    }
 
-        romfile.seekg(0, romfile.beg);
-        ROM = (uint8_t *)malloc(rom_size);
+    // share RAM banks with a cart forked from this one
+    void share_with(Cart &child) {
+        for (unsigned i = 0; i < ram_banks; ++i)
+            RAM_BANKS[i].share_with(child.RAM_BANKS[i]);
+    }
 
-        romfile.read((char *)ROM, rom_size);
-        romfile.close();
+    void release_shared() {
+        for (SharedRegion &bank : RAM_BANKS)
+            bank.release();
+    }
 
-        // cart data reference http://www.devrs.com/gb/files/gbspec.txt
+    // 256-byte pages of cartridge RAM written since the last clear_dirty()
+    vector<uint64_t> ram_dirty;
 
-        char rom_name[16];
-        memcpy(rom_name, &ROM[0x0134], 16);
-        uint8_t cart_type = ROM[0x0147];
+    bool is_dirty(unsigned page) const {
+        return (ram_dirty[page >> 6] >> (page & 63)) & 1;
+    }
 
+    void mark_dirty(unsigned page) {
+        ram_dirty[page >> 6] |= uint64_t(1) << (page & 63);
+    }
+
+    void clear_dirty() {
+        fill(ram_dirty.begin(), ram_dirty.end(), 0);
+    }
+
+    void mark_all_dirty() {
+        fill(ram_dirty.begin(), ram_dirty.end(), ~uint64_t(0));
+    }
+
+    // cartridge RAM size in bytes declared by the ROM header
+    static unsigned ram_size_of(const uint8_t *rom) {
+        uint8_t ram_type = rom[0x0149];
+        if (!ram_types.count(ram_type))
+            throw header_error("unknown cart RAM type", ram_type);
+        return 0x2000 * ram_types.at(ram_type).second;
+    }
+
+    // memory bank controller named by the cart type byte, unknown types are run as plain ROM
+    static mbc_type mbc_of(uint8_t cart_type) {
         switch (cart_type) {
             default:
             case 0x00:
-                bank_controller = mbc_type::NONE;
-                break;
+                return mbc_type::NONE;
             case 0x01:
             case 0x02:
             case 0x03:
-                bank_controller = mbc_type::MBC1;
-                break;
+                return mbc_type::MBC1;
             case 0x05:
             case 0x06:
-                bank_controller = mbc_type::MBC2;
-                break;
+                return mbc_type::MBC2;
             case 0x0F:
             case 0x10:
             case 0x11:
             case 0x12:
             case 0x13:
-                bank_controller = mbc_type::MBC3;
-                break;
+                return mbc_type::MBC3;
             case 0x19:
             case 0x1A:
             case 0x1B:
             case 0x1C:
             case 0x1D:
             case 0x1E:
-                bank_controller = mbc_type::MBC5;
-                break;
+                return mbc_type::MBC5;
         }
+    }
 
-        uint8_t rom_type = ROM[0x0148];
-        if (rom_types.count(rom_type)) {
-            rom_banks = rom_types[rom_type].second;
-            assert(rom_banks == rom_size / 0x4000);
-        } else {
-            printf("Unknown cart ROM type 0x%02X\n", rom_type);
-            exit(1);
+    // throws std::runtime_error unless the image holds a header this emulator can run and all the ROM banks it
+    // declares. Everything else in Cart assumes a checked header.
+    static void check_header(const RomImage &rom) {
+        if (rom.size < 0x0150)
+            throw runtime_error("ROM file is too small for a cartridge header");
+
+        uint8_t rom_type = rom.data[0x0148];
+        if (!rom_types.count(rom_type))
+            throw header_error("unknown cart ROM type", rom_type);
+        if (rom.size < 0x4000 * rom_types.at(rom_type).second)
+            throw runtime_error("ROM file is truncated, the header declares " + rom_types.at(rom_type).first);
+
+        ram_size_of(rom.data);
+
+        mbc_type mbc = mbc_of(rom.data[0x0147]);
+        if (mbc == mbc_type::MBC2 || mbc == mbc_type::MBC5)
+            throw header_error("unsupported memory bank controller in cart type", rom.data[0x0147]);
+    }
+
+    static bool has_rtc(const uint8_t *rom) {
+        return rom[0x0147] >= 0x0F && rom[0x0147] <= 0x13;
+    }
+
+    // bytes of cartridge memory kept in the machine state: the RAM banks, then the MBC3 clock registers
+    static unsigned state_size_of(const uint8_t *rom) {
+        return ram_size_of(rom) + (has_rtc(rom) ? CART_RTC_SIZE : 0);
+    }
+
+    // RAM contents survive power-off, see BatterySave
+    static bool has_battery(const uint8_t *rom) {
+        switch (rom[0x0147]) {
+            case 0x03:
+            case 0x06:
+            case 0x09:
+            case 0x0D:
+            case 0x0F:
+            case 0x10:
+            case 0x13:
+            case 0x1B:
+            case 0x1E:
+                return true;
+            default:
+                return false;
         }
+    }
+
+    // cartridge memory (state_size_of(rom) bytes) and banking state live in the machine state.
+    // The ROM must pass check_header.
+    Cart(shared_ptr<const RomImage> rom, CartState &StateRef, uint8_t *ram, bool print_to_stdout = false)
+        : mbc_mode(StateRef.mbc_mode), ROM(rom->data), RAM(ram), RTC_registers(nullptr),
+          RTC_reg_select(StateRef.RTC_reg_select), RTC_access(StateRef.RTC_access), rom_bank(StateRef.rom_bank),
+          ram_bank(StateRef.ram_bank), rom_size(rom->size), rom_owner(rom) {
+
+        mbc_mode = controller_mode::ROM_banking;
+        rom_bank = 1;
+        ram_bank = 0;
+
+        // cart data reference http://www.devrs.com/gb/files/gbspec.txt
+
+        char rom_name[16];
+        memcpy(rom_name, &ROM[0x0134], 16);
+        uint8_t cart_type = ROM[0x0147];
+
+        bank_controller = mbc_of(cart_type);
+
+        uint8_t rom_type = ROM[0x0148];
+        rom_banks        = rom_types.at(rom_type).second;
 
         uint8_t ram_type = ROM[0x0149];
-        if (ram_types.count(ram_type)) {
-            ram_banks = ram_types[ram_type].second;
-            ram_size  = 0x2000 * ram_banks;
-            RAM       = (uint8_t *)malloc(ram_size);
-        } else {
-            printf("Unknown cart RAM type 0x%02X\n", ram_type);
-            exit(1);
-        }
+        ram_size         = ram_size_of(ROM);
+        ram_banks        = ram_size / 0x2000;
+
+        for (unsigned i = 0; i < ram_banks; ++i)
+            RAM_BANKS.emplace_back(&RAM[0x2000 * i], 0x2000);
+        ram_dirty.resize(ram_banks / 2 + 1); // 32 pages per bank
+
+        if (has_rtc(ROM))
+            RTC_registers = &RAM[ram_size];
 
         // TODO: compute checksum
         if (print_to_stdout) {
@@ -134,19 +236,41 @@ class Cart {
 
             printf("SIZE:\t%dK\n", rom_size / 1024);
             if (cart_types.count(cart_type)) {
-                printf("CART:\t%s\n", cart_types[cart_type].c_str());
+                printf("CART:\t%s\n", cart_types.at(cart_type).c_str());
             } else {
                 printf("Unknown type 0x%02X\n", cart_type);
             }
 
-            printf("ROM:\t%s\n", rom_types[rom_type].first.c_str());
-            printf("RAM:\t%s\n", ram_types[ram_type].first.c_str());
+            printf("ROM:\t%s\n", rom_types.at(rom_type).first.c_str());
+            printf("RAM:\t%s\n", ram_types.at(ram_type).first.c_str());
 
             printf("CPL:\t0x%02X\n", ROM[0x014D]);
             printf("CHK:\t0x%02X 0x%02X\n", ROM[0x014E], ROM[0x014F]);
         }
     }
 
+    // cart for a forked emulator, sharing the parent's ROM image (banking state is copied with the machine state)
+    Cart(const Cart &parent, CartState &StateRef, uint8_t *ram)
+        : bank_controller(parent.bank_controller), mbc_mode(StateRef.mbc_mode), ROM(parent.ROM), RAM(ram),
+          RTC_registers(nullptr), RTC_reg_select(StateRef.RTC_reg_select),
+          RTC_access(StateRef.RTC_access), rom_bank(StateRef.rom_bank), ram_bank(StateRef.ram_bank),
+          rom_size(parent.rom_size), ram_size(parent.ram_size), rom_banks(parent.rom_banks),
+          ram_banks(parent.ram_banks), rom_owner(parent.rom_owner) {
+
+        for (unsigned i = 0; i < ram_banks; ++i)
+            RAM_BANKS.emplace_back(&RAM[0x2000 * i], 0x2000);
+        ram_dirty.resize(ram_banks / 2 + 1); // 32 pages per bank
+
+        // the clock registers are not shared
+        if (parent.RTC_registers) {
+            RTC_registers = &RAM[ram_size];
+            memcpy(RTC_registers, parent.RTC_registers, CART_RTC_SIZE);
+        }
+    }
+
+    Cart(Cart const &)          = delete;
+    void operator=(Cart const &) = delete;
+
   private:
     unsigned rom_size;
     unsigned ram_size;
@@ -154,7 +278,15 @@ class Cart {
     unsigned rom_banks; // Max ROM size 8 MB
     unsigned ram_banks; // Max RAM size 128 KB
 
-    map<uint8_t, string> cart_types{
+    shared_ptr<const RomImage> rom_owner; // shared with other carts running the same ROM
+
+    static runtime_error header_error(const char *what, uint8_t value) {
+        char message[80];
+        snprintf(message, sizeof(message), "%s 0x%02X", what, value);
+        return runtime_error(message);
+    }
+
+    static inline const map<uint8_t, string> cart_types{
         {0x00, "ROM ONLY"},
         {0x01, "ROM+MBC1"},
         {0x02, "ROM+MBC1+RAM"},
@@ -182,40 +314,10 @@ class Cart {
         {0xFE, "Hudson HuC-3"},
         {0xFF, "Hudson HuC-1"}};
 
-    map<uint8_t, pair<string, unsigned>> rom_types{
+    static inline const map<uint8_t, pair<string, unsigned>> rom_types{
         {0x00, {"32KB", 2}}, {0x01, {"64KB", 4}},  {0x02, {"128KB", 8}},  {0x03, {"256KB", 16}}, {0x04, {"512KB", 32}},
         {0x05, {"1MB", 64}}, {0x06, {"2MB", 128}}, {0x52, {"1.1MB", 72}}, {0x53, {"1.2MB", 80}}, {0x54, {"1.5MB", 96}}};
 
-    map<uint8_t, pair<string, unsigned>> ram_types{
+    static inline const map<uint8_t, pair<string, unsigned>> ram_types{
         {0x00, {"None", 0}}, {0x01, {"2KB", 1}}, {0x02, {"8KB", 1}}, {0x03, {"32KB", 4}}, {0x04, {"128KB", 16}}};
-
-    friend std::ostream &operator<<(std::ostream &out, const Cart &c) {
-        out.write(reinterpret_cast<const char *>(&c.rom_size), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.ram_size), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.ram_banks), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.rom_banks), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.ram_bank), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.rom_bank), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(&c.RTC_access), sizeof(bool));
-        out.write(reinterpret_cast<const char *>(&c.RTC_reg_select), sizeof(unsigned));
-        out.write(reinterpret_cast<const char *>(c.RTC_registers), sizeof(c.RTC_registers));
-        out.write(reinterpret_cast<const char *>(c.RAM), c.ram_size * sizeof(uint8_t));
-
-        return out;
-    }
-
-    friend std::istream &operator>>(std::istream &in, Cart &c) {
-        in.read(reinterpret_cast<char *>(&c.rom_size), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.ram_size), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.ram_banks), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.rom_banks), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.ram_bank), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.rom_bank), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(&c.RTC_access), sizeof(bool));
-        in.read(reinterpret_cast<char *>(&c.RTC_reg_select), sizeof(unsigned));
-        in.read(reinterpret_cast<char *>(c.RTC_registers), sizeof(c.RTC_registers));
-        in.read(reinterpret_cast<char *>(c.RAM), c.ram_size * sizeof(uint8_t));
-
-        return in;
-    }
 };
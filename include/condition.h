@@ -0,0 +1,57 @@
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+
+class Memory;
+
+/*
+ * Stop condition for gbe::run_until, built from memory tests such as "0xC0A0
+ * equals 3" or "bit 7 of 0xFF41 is set". Tests are ANDed within a group and
+ * the condition holds when any group does. Addresses are read without
+ * breakpoint checks, so evaluating after every instruction stays cheap.
+ */
+class RunCondition {
+  public:
+    enum test {
+        EQUALS,  // byte == value
+        CHANGES, // byte differs from its value when the run started
+        EXCEEDS, // byte > value
+        BIT_SET  // bit value of byte is 1
+    };
+
+    // how often the condition is evaluated
+    enum granularity { INSTRUCTION, SCANLINE, FRAME };
+
+    struct Test {
+        uint16_t addr;
+        test type;
+        uint8_t value;
+    };
+
+    granularity check_every = FRAME;
+
+    void equals(uint16_t addr, uint8_t value);
+    void changes(uint16_t addr);
+    void exceeds(uint16_t addr, uint8_t value);
+    void bit_set(uint16_t addr, unsigned bit);
+
+    // tests added after this form a new group, ORed with the previous ones
+    void alternative();
+
+    bool empty() const {
+        return tests.empty();
+    }
+
+    // record the values CHANGES tests compare against
+    void arm(Memory &mem);
+
+    bool holds(Memory &mem) const;
+
+  private:
+    std::vector<Test> tests;
+    std::vector<unsigned> group_end; // one past the last test of each finished group
+    std::vector<uint8_t> initial;    // per test, set by arm()
+
+    void add(uint16_t addr, test type, uint8_t value);
+};
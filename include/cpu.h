@@ -4,6 +4,7 @@
 #include <inttypes.h>
 
 #include "reg.h"
+#include "state.h"
 
 #define ISR_VBLANK 0x0040
 #define ISR_LCD    0x0048
@@ -27,9 +28,12 @@ class Cpu {
         void (*fn)(Cpu &);
     } Instruction;
 
-    Cpu(Memory &MemRef, Registers &RegRef) : MEM(MemRef), REG(RegRef) {
-        init_instructions();
-        init_ext_instructions();
+    Cpu(Memory &MemRef, Registers &RegRef, CpuState &StateRef) : MEM(MemRef), REG(RegRef), stuck_flag(StateRef.stuck) {
+        stuck_flag = false;
+
+        // the opcode tables are shared by all instances, fill them once
+        static bool initialized = (init_instructions(), init_ext_instructions(), true);
+        (void)initialized;
     }
 
     Memory &MEM;
@@ -53,17 +57,17 @@ class Cpu {
         return readWord(REG.PC - 2);
     }
 
-    Instruction instructions[256];
-    Instruction ext_instructions[256];
+    static inline Instruction instructions[256];
+    static inline Instruction ext_instructions[256];
 
     bool is_stuck() {
         return stuck_flag;
     }
 
   private:
-    bool stuck_flag = false;
-    void init_instructions();
-    void init_ext_instructions();
+    bool &stuck_flag;
+    static void init_instructions();
+    static void init_ext_instructions();
 
     void nop() {
         REG.TCLK = 4;
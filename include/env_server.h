@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <inttypes.h>
+#include <string>
+
+#include "gbe.h"
+
+#define SERVER_MAGIC       0x52534247u // "GBSR"
+#define SERVER_VERSION     1u
+#define SERVER_MAX_WORKERS 256u
+#define SERVER_MAX_VALUES  64u // watched addresses per environment
+
+// commands of a slot request
+#define SERVER_STEP  0u // hold buttons for repeat frames, then write screen and values
+#define SERVER_RESET 1u // reset, then write screen and values
+#define SERVER_SAVE  2u // write the machine state to the snapshot area
+#define SERVER_LOAD  3u // restore the machine state from the snapshot area, then write values
+
+// status of a finished request
+#define SERVER_OK      0u
+#define SERVER_STUCK   1u // the CPU got stuck
+#define SERVER_CRASHED 2u // the worker process died, the environment is back at its power-on state
+#define SERVER_FAILED  3u // bad request, e.g. an unknown command
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared counters must work across processes");
+
+/*
+ * Shared memory layout of gbe_server. A header is followed by one slot per
+ * environment. A client fills in a slot's command and bumps its request
+ * number, the worker owning the environment carries it out and sets done to
+ * the same number. Waiting on both sides is on futex words: a per-worker
+ * counter the client increments when it submits, and a completion counter
+ * the workers increment when they finish.
+ */
+struct ServerHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t env_count;
+    uint32_t worker_count;
+    uint32_t state_size;  // bytes of the snapshot area of each slot
+    uint32_t value_count; // watched addresses, gathered into the values of each slot
+    uint32_t slot_size;
+    uint32_t slot_offset; // of slot 0 from the start of the mapping
+    uint16_t watch[SERVER_MAX_VALUES];
+
+    alignas(64) std::atomic<uint32_t> completed;
+    std::atomic<uint32_t> shutdown;
+    alignas(64) std::atomic<uint32_t> submitted[SERVER_MAX_WORKERS]; // per worker
+};
+
+struct ServerSlot {
+    alignas(64) std::atomic<uint32_t> request;
+    uint32_t command;
+    uint32_t repeat;
+    uint8_t buttons; // KEY_* bits
+
+    alignas(64) std::atomic<uint32_t> done;
+    uint32_t status;
+    uint32_t lost; // set when a worker restarted while the slot was idle, reported as SERVER_CRASHED next time
+    int32_t values[SERVER_MAX_VALUES];
+    uint8_t screen[LCD_H * LCD_W]; // shades, top row first
+
+    alignas(64) uint8_t snapshot[1]; // state_size bytes
+
+    static size_t size_for(size_t state_size) {
+        return (offsetof(ServerSlot, snapshot) + state_size + 63) & ~size_t(63);
+    }
+};
+
+/*
+ * A mapping of the shared memory of a server, on the server or client side.
+ */
+class ServerChannel {
+  public:
+    // create and map a new shared memory object, or attach to an existing one. nullptr on errors.
+    static ServerChannel *create(
+        const std::string &name, unsigned env_count, unsigned worker_count, unsigned state_size,
+        const uint16_t *watch, unsigned value_count
+    );
+    static ServerChannel *attach(const std::string &name);
+
+    ~ServerChannel();
+
+    ServerChannel(ServerChannel const &)  = delete;
+    void operator=(ServerChannel const &) = delete;
+
+    ServerHeader *header;
+
+    unsigned size() const {
+        return header->env_count;
+    }
+
+    ServerSlot &slot(unsigned env) {
+        return *reinterpret_cast<ServerSlot *>(
+            reinterpret_cast<uint8_t *>(header) + header->slot_offset + size_t(env) * header->slot_size
+        );
+    }
+
+    unsigned worker_of(unsigned env) const {
+        return env % header->worker_count;
+    }
+
+    // client side: hand a request to the slot's worker
+    void submit(unsigned env, uint32_t command, uint8_t buttons = 0, uint32_t repeat = 1);
+
+    // client side: block until every submitted request is done
+    void wait_all();
+
+    // server side: finish the slot's current request with status
+    void complete(unsigned env, uint32_t status);
+
+    // block while *word == value
+    static void wait(std::atomic<uint32_t> &word, uint32_t value);
+    static void wake(std::atomic<uint32_t> &word);
+
+  private:
+    ServerChannel(const std::string &name, void *mapping, size_t bytes, bool owner);
+
+    std::string name;
+    size_t bytes;
+    bool owner; // unlinks the shared memory object when destroyed
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+
+/*
+ * Turns LCD shade frames into the observations agents train on: a crop of
+ * the screen, area-averaged to the output size, as gray levels (those of
+ * display()) or averaged shade indices, with the last few frames stacked.
+ * Resampling weights are computed once, so processing a frame is two passes
+ * of small fixed-point dot products.
+ */
+class FramePipeline {
+  public:
+    // crop_* select the screen area used (in LCD pixels), height x width is the output size of one frame
+    FramePipeline(
+        unsigned crop_top, unsigned crop_left, unsigned crop_height, unsigned crop_width, unsigned height,
+        unsigned width, bool grayscale, unsigned stack
+    );
+
+    const unsigned height;
+    const unsigned width;
+    const unsigned stack;
+    const bool grayscale;
+
+    unsigned frame_size() const {
+        return height * width;
+    }
+
+    // bytes written by write()
+    unsigned size() const {
+        return stack * frame_size();
+    }
+
+    // add a frame (LCD_H * LCD_W shades) to the stack, dropping the oldest
+    void push(const uint8_t *shades);
+
+    // replace all stacked frames with this one, e.g. at the start of an episode
+    void fill(const uint8_t *shades);
+
+    // stacked frames, oldest first (stack x height x width)
+    void write(uint8_t *out) const;
+
+  private:
+    // resampling of one axis: output pixel i averages taps source pixels from first[i] on, with weights
+    // summing to 256
+    struct Axis {
+        unsigned taps;
+        std::vector<unsigned> first;
+        std::vector<uint16_t> weights; // taps per output pixel
+    };
+
+    unsigned crop_top, crop_left, crop_height, crop_width;
+    Axis rows, columns;
+
+    std::vector<uint8_t> frames; // ring of stack frames
+    unsigned newest;
+
+    std::vector<uint8_t> cropped;       // crop of the frame as output levels
+    std::vector<uint16_t> column_sums; // one output row resampled vertically, scaled by 256
+
+    static Axis make_axis(unsigned in, unsigned out);
+
+    void process(const uint8_t *shades, uint8_t *out);
+};
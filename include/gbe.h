@@ -3,6 +3,11 @@
 #include <array>
 #include <string>
 #include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "sound_defs.h"
 
 #define LCD_W 160u
 #define LCD_H 144u
@@ -16,31 +21,217 @@ class Gpu;
 class Timer;
 class Cpu;
 class SerialPortInterface;
+class BatterySave;
+class ObservationSchema;
+class RunCondition;
+class FramePipeline;
+struct MachineState;
 
 /*
  * Minimal interface for operating gbe
  */
 class gbe {
   public:
-    gbe(std::string romfile, std::function<void(uint8_t)> serial_send_cb = [](uint8_t) {});
+    // with battery_save, cartridge RAM of battery-backed carts is kept in a .sav file next to the ROM.
+    // Throws std::runtime_error if the ROM file can't be read or its cartridge header is not supported.
+    gbe(
+        std::string romfile, std::function<void(uint8_t)> serial_send_cb = [](uint8_t) {}, bool battery_save = false
+    );
+    ~gbe();
+
+    gbe(gbe const &)            = delete;
+    void operator=(gbe const &) = delete;
 
-    // get current contents of lcd display (160 * RGB * 144 bytes)
+    // get current contents of lcd display (160 * RGB * 144 bytes, bottom row first).
+    // The RGB buffer is allocated on the first call.
     uint8_t *display();
 
+    // current frame as shades 0 (white) - 3 (black), 160 * 144 bytes, top row first
+    const uint8_t *screen() const;
+
     // run emulator for some clock cycles (70224 cycles per frame when LCD is enabled)
     bool run(long clock_cycles);
 
     // run emulator until next complete frame is rendered
     bool run_to_vblank();
 
+    enum run_result { CONDITION_MET, TIMEOUT, STUCK };
+
+    // run until condition holds, checked at its granularity, or until max_cycles clock cycles or (if nonzero)
+    // max_frames frames have passed. CHANGES tests compare against the memory contents at the start of the run.
+    run_result run_until(RunCondition &condition, long max_cycles, unsigned max_frames = 0);
+
     // set button states (lasts until next input call)
     void input(bool up, bool down, bool left, bool right, bool a, bool b, bool start, bool select);
 
+    // button states as the KEY_* bitmask taken by step()
+    static uint8_t button_mask(bool up, bool down, bool left, bool right, bool a, bool b, bool start, bool select);
+
+    // hold buttons (see button_mask) for repeat frames, false if the CPU got stuck
+    bool step(uint8_t buttons, unsigned repeat = 1);
+
+    // step() on a new thread. The instance must not be used until the future is ready.
+    std::future<bool> step_async(uint8_t buttons, unsigned repeat = 1);
+
+    // options for step(). With max_pool, observation() is the per-pixel maximum (darker shade) of the last two
+    // frames, which removes sprite flicker. With sticky_prob > 0 each frame keeps the previous frame's buttons
+    // with that probability, drawn from a per-instance generator seeded with seed.
+    void configure_step(bool max_pool, double sticky_prob = 0, uint64_t seed = 0);
+
+    // frame after the last step(): screen(), or the max-pooled frame (160 * 144 shades, top row first)
+    const uint8_t *observation() const;
+
+    // process the frames of step() with a copy of pipeline (cropped, downsampled and stacked), nullptr turns
+    // processing off. The stack is filled with the current frame, and again on reset().
+    void configure_observation(const FramePipeline *pipeline);
+
+    // configured pipeline, nullptr if frames are not processed
+    const FramePipeline *observation_pipeline() const {
+        return PIPELINE;
+    }
+
+    // bytes written by write_observation(): the pipeline's size(), or LCD_W * LCD_H without one
+    size_t observation_size() const;
+
+    // processed frame stack, or a copy of observation()
+    void write_observation(uint8_t *out) const;
+
+    // capture serial output natively and watch it for patterns, see serial_match()
+    void capture_serial(const std::vector<std::string> &patterns, size_t max_bytes = 4096);
+
+    // serial output since capture_serial()
+    const std::string &serial_output() const;
+
+    // index of the first pattern that appeared in the serial output, -1 while none has
+    int serial_match() const;
+
     // read memory at location addr
     uint8_t mem(uint16_t addr);
 
+    // copy count bytes from addr on to out, as mem() would read them but without breakpoint checks
+    void read_memory(uint16_t addr, uint8_t *out, size_t count);
+
+    // gather the fields of schema into values() at every vblank run_to_vblank() returns on, and after a
+    // state load or reset. An empty schema turns gathering off.
+    void set_observation_schema(const ObservationSchema &schema);
+
+    // one value per field of the observation schema, in schema order
+    const int32_t *values() const {
+        return schema_values.data();
+    }
+
+    unsigned value_count() const {
+        return schema_values.size();
+    }
+
+    // create a child emulator in the current state. It shares this instance's ROM, and its VRAM, WRAM
+    // and cart RAM until either side writes to them (copy-on-write per region). The child's display()
+    // is blank until it renders a frame of its own. Caller owns the returned instance.
+    gbe *fork();
+
+    // size in bytes of a machine state snapshot (fixed for a given ROM)
+    size_t state_size() const;
+
+    // copy the machine state to buffer (state_size() bytes)
+    void save_state(uint8_t *buffer) const;
+
+    // restore a machine state saved from an emulator running the same ROM. Throws std::invalid_argument,
+    // leaving the current state as it was, if the state's cartridge RAM size does not match the ROM.
+    void load_state(const uint8_t *buffer);
+
+    // path the ROM was loaded from
+    const std::string &rom_path() const {
+        return romfile;
+    }
+
+    // hash of the ROM contents, for checking that a saved state belongs to this ROM
+    uint64_t rom_hash() const;
+
+    // return to the reset state: the power-on state unless changed by set_reset_state or warm_start. With
+    // battery_save the cartridge RAM is kept, so the save file is not overwritten.
+    void reset();
+
+    // make the current state the one reset() returns to
+    void set_reset_state();
+
+    // advance to the state after idle_frames frames without input and make it the reset state. With a
+    // cache directory the state is loaded from, or stored to, <cache_dir>/<ROM hash>_<idle_frames>.state
+    void warm_start(unsigned idle_frames, const std::string &cache_dir = "");
+
+    // 64-bit hash of the machine state, equal for instances whose save_state output is equal.
+    // Memory is hashed incrementally as it is written, so this only reads about 1 KB of state.
+    uint64_t state_hash() const;
+
+    // start tracking modified pages from the current state
+    void checkpoint();
+
+    // 256-byte pages (state offset / 256) possibly modified since the last checkpoint
+    std::vector<unsigned> dirty_pages() const;
+
+    // pages that differ between two snapshots taken with save_state
+    std::vector<unsigned> diff_pages(const uint8_t *a, const uint8_t *b) const;
+
+    // buffer size sufficient for any incremental snapshot
+    size_t max_dirty_state_size() const;
+
+    // incremental snapshot holding only the dirty pages, returns the number of bytes written
+    size_t save_dirty_state(uint8_t *buffer) const;
+
+    // apply an incremental snapshot on top of the state it was checkpointed from
+    void load_dirty_state(const uint8_t *buffer);
+
+    // stream generated audio to a file (.wav or raw 16-bit PCM), optionally with per-channel mono stems.
+    // Throws std::runtime_error if a file can't be opened.
+    void record_audio(std::string filename, bool channel_stems = false);
+
+    // finish writing the current audio recording
+    void stop_recording();
+
+    // start or stop accumulating per-channel audio levels
+    void track_audio_features(bool enable);
+
+    // write AUDIO_FEATURES floats to out: for each of the 4 channels its active flag, frequency register,
+    // envelope volume and RMS level over the samples since the previous call (one frame after run_to_vblank)
+    void audio_features(float *out);
+
   private:
-    long clock_overflow;
+    gbe() = default;
+
+    // current contents of a state page, accounting for regions shared with a fork parent
+    const uint8_t *page(unsigned index) const;
+
+    uint8_t *writable_page(unsigned index);
+
+    std::string romfile;
+    std::function<void(uint8_t)> serial_send_cb;
+
+    // step() options and state
+    bool pool_frames   = false;
+    double sticky_prob = 0;
+    uint64_t rng_state = 0;
+    std::vector<uint8_t> pooled; // allocated on the first pooled step
+
+    FramePipeline *PIPELINE = nullptr;
+
+    ObservationSchema *SCHEMA = nullptr;
+    std::vector<int32_t> schema_values;
+
+    void gather_values();
+
+    // execute one instruction (or one halted cycle) and service interrupts, advancing the other components with it.
+    // Returns the clock cycles taken, new_frame is set when this step started a new frame.
+    long step_instruction(bool &new_frame);
+
+    // load_state for reset and warm start states, which leaves the cartridge RAM of a mapped save file alone
+    void restore(const uint8_t *buffer);
+
+    double next_random();
+
+    // shared with forks and with other instances powered on with the same ROM
+    std::shared_ptr<const std::vector<uint8_t>> reset_state;
+
+    MachineState *STATE;
+    BatterySave *BATTERY = nullptr; // owns STATE when cartridge RAM is mapped from a save file
 
     Buttons *BTN;
     Sound *SND;
@@ -0,0 +1,111 @@
+#pragma once
+
+/*
+ * C interface of libgbe_c, for embedding the emulator from other languages
+ * through their FFI. Instances and pools are opaque handles. Nothing here
+ * allocates per call: frames, states and memory are copied into buffers
+ * owned by the caller, or read through pointers valid until the next call
+ * on the same handle. No C++ exception crosses the interface: a call that
+ * fails returns NULL or 0, or does nothing if it has no result.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define GBE_C_API __declspec(dllexport)
+#else
+#define GBE_C_API __attribute__((visibility("default")))
+#endif
+
+#define GBE_C_API_VERSION 1
+
+#define GBE_LCD_W 160
+#define GBE_LCD_H 144
+
+// button bits for gbe_step and gbe_set_input
+#define GBE_KEY_RIGHT  0x01
+#define GBE_KEY_LEFT   0x02
+#define GBE_KEY_UP     0x04
+#define GBE_KEY_DOWN   0x08
+#define GBE_KEY_A      0x10
+#define GBE_KEY_B      0x20
+#define GBE_KEY_SELECT 0x40
+#define GBE_KEY_START  0x80
+
+typedef struct gbe_instance gbe_instance;
+typedef struct gbe_pool gbe_pool;
+
+// GBE_C_API_VERSION the library was built with
+GBE_C_API unsigned gbe_api_version(void);
+
+// NULL if the ROM file can't be read or its cartridge type is not supported
+GBE_C_API gbe_instance *gbe_create(const char *romfile);
+GBE_C_API void gbe_destroy(gbe_instance *instance);
+
+// copy-on-write child in the current state, destroyed with gbe_destroy
+GBE_C_API gbe_instance *gbe_fork(gbe_instance *instance);
+
+// hold buttons (GBE_KEY_* bits) until the next call
+GBE_C_API void gbe_set_input(gbe_instance *instance, uint8_t buttons);
+
+// run frames frames with the current input, 0 if the CPU got stuck
+GBE_C_API int gbe_run_frames(gbe_instance *instance, unsigned frames);
+
+// hold buttons for repeat frames with the step options of the instance, 0 if the CPU got stuck
+GBE_C_API int gbe_step(gbe_instance *instance, uint8_t buttons, unsigned repeat);
+
+// last frame as shades 0 (white) - 3 (black), GBE_LCD_W * GBE_LCD_H bytes, top row first
+GBE_C_API const uint8_t *gbe_framebuffer(const gbe_instance *instance);
+
+// last frame as RGB, GBE_LCD_W * 3 * GBE_LCD_H bytes, bottom row first
+GBE_C_API const uint8_t *gbe_framebuffer_rgb(gbe_instance *instance);
+
+// copy count bytes of the address space from addr on to out
+GBE_C_API void gbe_read_memory(gbe_instance *instance, uint16_t addr, uint8_t *out, size_t count);
+
+// snapshot size in bytes, fixed for a ROM
+GBE_C_API size_t gbe_state_size(const gbe_instance *instance);
+
+GBE_C_API void gbe_save_state(const gbe_instance *instance, uint8_t *buffer);
+
+// 0 if size does not match gbe_state_size or the state is from a cart with another RAM size
+GBE_C_API int gbe_load_state(gbe_instance *instance, const uint8_t *buffer, size_t size);
+
+GBE_C_API void gbe_reset(gbe_instance *instance);
+
+GBE_C_API uint64_t gbe_state_hash(const gbe_instance *instance);
+
+// count instances of romfile stepped by threads threads (0: one per hardware thread), NULL if the ROM
+// can't be run (see gbe_create)
+GBE_C_API gbe_pool *gbe_pool_create(const char *romfile, unsigned count, unsigned threads);
+GBE_C_API void gbe_pool_destroy(gbe_pool *pool);
+
+GBE_C_API unsigned gbe_pool_size(const gbe_pool *pool);
+
+// instance of the pool, owned by it
+GBE_C_API gbe_instance *gbe_pool_get(gbe_pool *pool, unsigned index);
+
+// bytes gathered into ram for each instance
+GBE_C_API void gbe_pool_watch(gbe_pool *pool, const uint16_t *addresses, unsigned count);
+
+// bytes per instance in the screens output of gbe_pool_step
+GBE_C_API size_t gbe_pool_observation_size(const gbe_pool *pool);
+
+// step every instance with its row of 8 action bytes (up, down, left, right, a, b, start, select; nonzero =
+// pressed) for repeat frames. Writes screens (size x observation size), ram (size x watched count) and
+// done (size, 1 if the CPU got stuck), NULL outputs are skipped.
+GBE_C_API void gbe_pool_step(
+    gbe_pool *pool, const uint8_t *actions, unsigned repeat, uint8_t *screens, int32_t *ram, uint8_t *done
+);
+
+// reset the instances selected by mask (size bytes, NULL for all) and write their outputs like gbe_pool_step
+GBE_C_API void gbe_pool_reset(gbe_pool *pool, const uint8_t *mask, uint8_t *screens, int32_t *ram);
+
+#ifdef __cplusplus
+}
+#endif
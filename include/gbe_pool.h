@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_pipeline.h"
+#include "gbe.h"
+#include "observation.h"
+
+#define POOL_BUTTONS 8u // action columns: up, down, left, right, a, b, start, select
+
+/*
+ * A batch of emulators running the same ROM, stepped together by a fixed set
+ * of worker threads. Instances are handed out to the workers one at a time,
+ * so a slow instance does not hold up a whole chunk.
+ */
+class GbePool {
+  public:
+    // work is split across threads (including the calling one), 0 uses one per hardware thread.
+    // Throws like the gbe constructor if the ROM can't be run.
+    GbePool(const std::string &romfile, unsigned count, unsigned threads = 0);
+    ~GbePool();
+
+    GbePool(GbePool const &)        = delete;
+    void operator=(GbePool const &) = delete;
+
+    unsigned size() const {
+        return instances.size();
+    }
+
+    gbe &operator[](unsigned index) {
+        return *instances[index];
+    }
+
+    // fields gathered by every instance at vblank and written to the ram output of step(), in order
+    void watch(const ObservationSchema &schema);
+
+    // watch single bytes
+    void watch(const std::vector<uint16_t> &addresses);
+
+    const ObservationSchema &watched() const {
+        return schema;
+    }
+
+    // run fn(instance, index) for every instance on the workers and the calling thread, returns when all calls
+    // are done
+    void for_each(const std::function<void(gbe &, unsigned)> &fn);
+
+    // gbe::step() every instance with its row of actions (size() x POOL_BUTTONS, nonzero = pressed).
+    // Then write its observation (size() x observation_size(), see gbe::write_observation), the watched values
+    // (size() x watched().size()) and done (size(), 1 if the CPU got stuck). Null outputs are skipped.
+    void step(const uint8_t *actions, uint8_t *screens, int32_t *ram, uint8_t *done, unsigned repeat = 1);
+
+    // handle of an asynchronous step. Outputs may be read once ready() is true or wait() has returned.
+    class Completion {
+      public:
+        bool ready() const {
+            return pool->finished(generation);
+        }
+
+        // block until the step is done, the calling thread steps instances not started yet
+        void wait() const {
+            pool->finish(generation);
+        }
+
+      private:
+        friend class GbePool;
+        Completion(GbePool *pool, unsigned generation) : pool(pool), generation(generation) {}
+
+        GbePool *pool;
+        unsigned generation;
+    };
+
+    // start step() on the worker threads and return without waiting. actions and the outputs must stay valid
+    // until the step is done. Any other call on the pool waits for it first. With a single thread there are no
+    // workers, and the instances are stepped in wait().
+    Completion step_async(const uint8_t *actions, uint8_t *screens, int32_t *ram, uint8_t *done, unsigned repeat = 1);
+
+    // block until a pending step_async is done
+    void wait() {
+        finish(generation);
+    }
+
+    // gbe::configure_observation() on every instance
+    void configure_observation(const FramePipeline *pipeline);
+
+    // bytes of each instance's observation in the screens output of step()
+    size_t observation_size() const {
+        return instances.empty() ? LCD_W * LCD_H : instances[0]->observation_size();
+    }
+
+    // gbe::configure_step() on every instance, instance i is seeded with seed + i
+    void configure_step(bool max_pool, double sticky_prob = 0, uint64_t seed = 0);
+
+    // reset the instances selected by mask (size() bytes, nullptr for all) and write their screens and
+    // watched values like step()
+    void reset(const uint8_t *mask, uint8_t *screens, int32_t *ram);
+
+  private:
+    std::vector<gbe *> instances;
+    ObservationSchema schema;
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable cond;
+
+    const std::function<void(gbe &, unsigned)> *job; // nullptr when idle
+    std::function<void(gbe &, unsigned)> async_job;  // of the pending step_async
+    unsigned generation;        // incremented for each for_each call
+    unsigned running;           // workers still busy with the current job
+    std::atomic<unsigned> next; // next instance to hand out
+    bool stopping;
+
+    void worker_loop();
+
+    void run_job(const std::function<void(gbe &, unsigned)> &fn);
+
+    // hand fn to the workers, after finishing the previous job. Returns its generation.
+    unsigned start(const std::function<void(gbe &, unsigned)> &fn);
+
+    // help with and wait for the job of a generation, if it is still running
+    void finish(unsigned generation);
+
+    bool finished(unsigned generation);
+
+    // write the observation and watched values of instance i to the outputs of step()
+    void observe(gbe &instance, unsigned i, uint8_t *screens, int32_t *ram);
+};
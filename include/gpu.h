@@ -2,6 +2,9 @@
 #include <array>
 #include <cstring>
 #include <iostream>
+#include <vector>
+
+#include "state.h"
 
 #define LCD_W 160u
 #define LCD_H 144u
@@ -60,30 +63,43 @@ class Memory;
 
 class Gpu {
   public:
-    Gpu(Memory &MemRef) : state({0, false}), MEM(MemRef) {
-        lcd_buffer.fill(0);
-        write_buffer.fill(0);
-        tilemap_buffer.fill(0);
-        tilemap_buffer.fill(0);
+    Gpu(Memory &MemRef, GpuState &StateRef) : state(StateRef), MEM(MemRef) {
+        state = {0, false};
+        shade_buffers[0].fill(COLOR_BLACK);
+        shade_buffers[1].fill(COLOR_BLACK);
     }
 
     void update(unsigned tclock);
 
-    struct {
-        unsigned clk;
-        bool enabled;
-    } state;
+    GpuState &state;
+
+    // last completed frame as shades COLOR_WHITE - COLOR_BLACK, one byte per pixel, top row first
+    const uint8_t *lcd_shades() const {
+        return shade_buffers[front_buffer].data();
+    }
 
-    std::array<uint8_t, LCD_H * LCD_W * 3> lcd_buffer;
-    std::array<uint8_t, TILEMAP_WINDOW_H * 2 * TILEMAP_WINDOW_W * 3> tilemap_buffer;
-    std::array<uint8_t, TILESET_WINDOW_H * TILESET_WINDOW_W * 3> tileset_buffer;
+    // the frame before that, until the next frame starts drawing over it
+    const uint8_t *lcd_previous_shades() const {
+        return shade_buffers[front_buffer ^ 1].data();
+    }
+
+    // last completed frame as RGB, bottom row first. Converted on each call.
+    uint8_t *lcd_rgb();
+
+    // RGB debug views, allocated on the first render
+    std::vector<uint8_t> tilemap_buffer;
+    std::vector<uint8_t> tileset_buffer;
 
     void render_tilemap();
 
     void render_tileset();
 
   private:
-    std::array<uint8_t, LCD_H * LCD_W * 3> write_buffer;
+    // the front buffer is displayed while the next frame is drawn to the other one
+    std::array<uint8_t, LCD_H * LCD_W> shade_buffers[2];
+    unsigned front_buffer = 0;
+
+    std::vector<uint8_t> rgb_buffer;
 
     void render_buffer_line();
 
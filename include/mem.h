@@ -4,6 +4,7 @@
 #include <inttypes.h>
 
 #include "cart.h"
+#include "state.h"
 
 typedef struct {
     uint8_t y;
@@ -29,65 +30,109 @@ class Sound;
 class Memory {
 
   public:
-    Memory(Cart &CartRef, Buttons &BtnRef, Sound &SndRef) : BTN(BtnRef), CART(CartRef), SND(SndRef) {
-
-        // Don't read ROM or cart RAM from RAW
-        // Fill with sentinel value (unused instruction 0xDD)
-        memset(&RAW[0x0000], 0xDD, 0x4000);
-        memset(&RAW[0x4000], 0xDD, 0x4000);
-        memset(&RAW[0xA000], 0xDD, 0x2000);
-    }
+    Memory(Cart &CartRef, Buttons &BtnRef, Sound &SndRef, MachineState &StateRef)
+        : BTN(BtnRef), CART(CartRef), SND(SndRef), STATE(StateRef), HIGH(StateRef.HIGH), VRAM(StateRef.VRAM, 0x2000),
+          WRAM(StateRef.WRAM, 0x2000), BIOS(StateRef.BIOS) {}
 
     Buttons &BTN;
     Cart &CART;
     Sound &SND;
-
-    uint8_t RAW[65536]; // TODO
-
-    uint8_t *const RAM   = &RAW[0xC000];
-    uint8_t *const _RAM  = &RAW[0xE000];
-    oam_entry *const OAM = (oam_entry *)(&RAW[0xFE00]);
-    uint8_t *const IO    = &RAW[0xFF00];
-    uint8_t *const ZERO  = &RAW[0xFF80];
-
-    uint8_t BIOS[256];
-
-    uint8_t *const SB       = &RAW[0xFF01];
-    uint8_t *const SC       = &RAW[0xFF02];
-    uint8_t *const DIV      = &RAW[0xFF04];
-    uint8_t *const TIMA     = &RAW[0xFF05];
-    uint8_t *const TMA      = &RAW[0xFF06];
-    uint8_t *const TAC      = &RAW[0xFF07];
-    uint8_t *const IF       = &RAW[0xFF0F];
-    uint8_t *const LCD_CTRL = &RAW[0xFF40];
-    uint8_t *const LCD_STAT = &RAW[0xFF41];
-    uint8_t *const SCRL_Y   = &RAW[0xFF42];
-    uint8_t *const SCRL_X   = &RAW[0xFF43];
-    uint8_t *const SCAN_LN  = &RAW[0xFF44]; // TODO: readonly
-    uint8_t *const LN_CMP   = &RAW[0xFF45];
-    uint8_t *const OAM_DMA  = &RAW[0xFF46]; // TODO: writeonly
-    uint8_t *const BG_PLT   = &RAW[0xFF47]; // TODO: writeonly
-    uint8_t *const OBJ0_PLT = &RAW[0xFF48]; // TODO: writeonly
-    uint8_t *const OBJ1_PLT = &RAW[0xFF49]; // TODO: writeonly
-    uint8_t *const WIN_Y    = &RAW[0xFF4A];
-    uint8_t *const WIN_X    = &RAW[0xFF4B];
-    uint8_t *const BIOS_OFF = &RAW[0xFF50];
-    uint8_t *const IE       = &RAW[0xFFFF];
-
-    uint8_t *const TILESET1 = &RAW[0x8000];
-    uint8_t *const TILESET0 = &RAW[0x8800];
-    uint8_t *const TILEMAP0 = &RAW[0x9800];
-    uint8_t *const TILEMAP1 = &RAW[0x9C00];
+    MachineState &STATE;
+
+    // 0xFE00 - 0xFFFF
+    uint8_t (&HIGH)[0x200];
+
+    // graphics and work RAM, possibly shared with a forked parent until written
+    SharedRegion VRAM;
+    SharedRegion WRAM;
+
+    oam_entry *const OAM = (oam_entry *)(&HIGH[0x000]);
+    uint8_t *const IO    = &HIGH[0x100];
+    uint8_t *const ZERO  = &HIGH[0x180];
+
+    uint8_t (&BIOS)[256];
+
+    uint8_t *const SB       = &HIGH[0x101];
+    uint8_t *const SC       = &HIGH[0x102];
+    uint8_t *const DIV      = &HIGH[0x104];
+    uint8_t *const TIMA     = &HIGH[0x105];
+    uint8_t *const TMA      = &HIGH[0x106];
+    uint8_t *const TAC      = &HIGH[0x107];
+    uint8_t *const IF       = &HIGH[0x10F];
+    uint8_t *const LCD_CTRL = &HIGH[0x140];
+    uint8_t *const LCD_STAT = &HIGH[0x141];
+    uint8_t *const SCRL_Y   = &HIGH[0x142];
+    uint8_t *const SCRL_X   = &HIGH[0x143];
+    uint8_t *const SCAN_LN  = &HIGH[0x144]; // TODO: readonly
+    uint8_t *const LN_CMP   = &HIGH[0x145];
+    uint8_t *const OAM_DMA  = &HIGH[0x146]; // TODO: writeonly
+    uint8_t *const BG_PLT   = &HIGH[0x147]; // TODO: writeonly
+    uint8_t *const OBJ0_PLT = &HIGH[0x148]; // TODO: writeonly
+    uint8_t *const OBJ1_PLT = &HIGH[0x149]; // TODO: writeonly
+    uint8_t *const WIN_Y    = &HIGH[0x14A];
+    uint8_t *const WIN_X    = &HIGH[0x14B];
+    uint8_t *const BIOS_OFF = &HIGH[0x150];
+    uint8_t *const IE       = &HIGH[0x1FF];
+
+    uint8_t *TILESET1() const {
+        return &VRAM.data[0x0000];
+    }
+    uint8_t *TILESET0() const {
+        return &VRAM.data[0x0800];
+    }
+    uint8_t *TILEMAP0() const {
+        return &VRAM.data[0x1800];
+    }
+    uint8_t *TILEMAP1() const {
+        return &VRAM.data[0x1C00];
+    }
 
     uint16_t break_addr = 0;
     bool at_breakpoint  = false;
 
+    // 256-byte state pages of VRAM (0 - 31) and WRAM (32 - 63) written through getWritePtr since the last
+    // clear_dirty(). OAM, IO and HRAM are also written directly by the components and count as always dirty.
+    uint64_t dirty = 0;
+
+    bool is_dirty(unsigned page) const {
+        return page >= 64 || (dirty >> page) & 1;
+    }
+
+    void mark_dirty(unsigned page) {
+        dirty |= uint64_t(1) << page;
+    }
+
+    // dirty flags of cart RAM are cleared and set along with these
+    void clear_dirty() {
+        dirty = 0;
+        CART.clear_dirty();
+    }
+
+    void mark_all_dirty() {
+        dirty = ~uint64_t(0);
+        CART.mark_all_dirty();
+    }
+
+    // store val at ptr (from getWritePtr), updating STATE.memory_hash if ptr is in VRAM, WRAM or cart memory
+    void store(uint8_t *ptr, uint8_t val) {
+        size_t offset = ptr - reinterpret_cast<uint8_t *>(&STATE);
+        if (STATE.is_hashed(offset))
+            STATE.memory_hash ^= state_byte_key(offset, *ptr) ^ state_byte_key(offset, val);
+        *ptr = val;
+    }
+
     uint8_t *getReadPtr(uint16_t addr);
 
     uint8_t *getWritePtr(uint16_t addr);
 
     uint8_t readByte(uint16_t addr);
 
+    // readByte without breakpoint checks or warnings, unmapped addresses read as 0
+    uint8_t peek(uint16_t addr);
+
+    // peek count bytes from addr on into out, copying whole mapped blocks at a time. Wraps at 0xFFFF.
+    void read_range(uint16_t addr, uint8_t *out, size_t count);
+
     uint16_t readWord(uint16_t addr);
 
     void writeByte(uint16_t addr, uint8_t val);
@@ -96,6 +141,12 @@ class Memory {
 
     uint64_t checksum() const;
 
+    // share VRAM, WRAM and cart RAM with a forked instance, copy-on-write on both sides
+    void share_with(Memory &child);
+
+    // drop shared regions after the state block was overwritten
+    void release_shared();
+
     friend std::ostream &operator<<(std::ostream &out, const Memory &mem);
     friend std::istream &operator>>(std::istream &in, Memory &mem);
 };
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+
+class Memory;
+
+/*
+ * A fixed list of memory fields read together, e.g. the score, lives and
+ * position a reward function needs. Fields are sorted into as few contiguous
+ * address ranges as possible when the schema is compiled, so gathering is a
+ * handful of block copies followed by decoding into one int32 per field.
+ */
+class ObservationSchema {
+  public:
+    enum field_type {
+        U8,     // one byte
+        U16LE,  // two bytes, low byte first
+        BCD,    // length bytes of packed decimal digits, most significant byte first
+        BCD_LE, // length bytes of packed decimal digits, least significant byte first
+        BITS    // width bits of one byte, starting at bit shift
+    };
+
+    struct Field {
+        uint16_t addr;
+        field_type type;
+        uint8_t length; // bytes read from addr
+        uint8_t shift;
+        uint8_t width;
+        unsigned offset; // position of the field's bytes in the gather buffer, set by compile()
+    };
+
+    void add_u8(uint16_t addr);
+    void add_u16le(uint16_t addr);
+
+    // up to 4 bytes (8 digits)
+    void add_bcd(uint16_t addr, unsigned bytes, bool little_endian = false);
+
+    void add_bits(uint16_t addr, unsigned shift, unsigned width);
+
+    // number of values written by gather()
+    unsigned size() const {
+        return fields.size();
+    }
+
+    const std::vector<Field> &get_fields() const {
+        return fields;
+    }
+
+    // merge the fields into read ranges, done by gather() if fields were added since
+    void compile();
+
+    // read all fields from mem into out (size() values, in the order they were added)
+    void gather(Memory &mem, int32_t *out);
+
+  private:
+    struct Range {
+        uint16_t addr;
+        unsigned length;
+        unsigned offset;
+    };
+
+    std::vector<Field> fields;
+    std::vector<Range> ranges;
+    std::vector<uint8_t> buffer;
+    bool compiled = true;
+
+    void add(uint16_t addr, field_type type, unsigned length, unsigned shift = 0, unsigned width = 8);
+};
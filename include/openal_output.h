@@ -4,9 +4,14 @@
 #include <iostream>
 #include <AL/al.h>
 
-#define AL_BUFFER_LEN_MS 5
-#define QUEUE_LEN_MS     15
-#define FORMAT           AL_FORMAT_STEREO16
+#define AL_BUFFER_LEN_MS  2
+#define QUEUE_LEN_MS      10
+#define TARGET_LATENCY_MS 8  // initial target, below QUEUE_LEN_MS; video pacing in SYNC_SLICES keeps bursts near 4 ms
+#define MAX_LATENCY_MS    60 // the target grows by a buffer per underrun up to this, for devices with long periods
+#define MAX_RATE_DELTA    0.005 // max +-0.5% pitch change, inaudible
+#define RATE_SMOOTHING    0.05
+#define RECLAIM_INTERVAL  64 // samples between played buffer checks while dropping
+#define FORMAT            AL_FORMAT_STEREO16
 
 class Sound;
 
@@ -19,6 +24,15 @@ class OpenAL_Output {
 
     unsigned queueSize();
 
+    // output samples per input sample, nudged towards target_latency_ms of queued audio
+    double rate_ratio;
+
+    // queued audio aimed for, starts at TARGET_LATENCY_MS and grows when the device runs dry
+    unsigned target_latency_ms;
+
+    // drop samples instead of queueing more than twice the target latency (fast-forward)
+    bool drop_excess;
+
     sample_t *sample_queue;
     unsigned queue_head;
     unsigned queue_tail;
@@ -33,6 +47,30 @@ class OpenAL_Output {
 
     unsigned long samples;
 
+    // times the source ran dry and had to be restarted
+    unsigned long underruns;
+
+  private:
+    // cubic resampler state: last 4 input frames and read position between hist[1] and hist[2]
+    float hist_l[4];
+    float hist_r[4];
+    double resample_pos;
+    bool resample_restart; // start over from the next input frame instead of interpolating from old ones
+
+    void resample(sample_t left, sample_t right);
+
+    void push_sample(sample_t left, sample_t right);
+
+    void update_rate();
+
+    bool refilling; // ran dry, waiting for the target latency of audio before playing again
+
+    double target_samples();
+
+    double queued_samples();
+
+    void reclaim_buffers();
+
     friend std::ostream &operator<<(std::ostream &out, const OpenAL_Output &oa);
     friend std::istream &operator>>(std::istream &in, OpenAL_Output &oa);
 };
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <inttypes.h>
+#include <vector>
+
+#define REWIND_BUDGET_MB         16u // default memory budget for the rewind history
+#define REWIND_KEYFRAME_INTERVAL 60u // frames per keyframe, deltas are taken against the latest keyframe
+#define REWIND_MERGE_WORDS       2u  // unchanged words allowed inside one literal run before it is split
+
+/*
+ * History of machine state snapshots (see gbe::save_state) for stepping
+ * backwards in time. Every REWIND_KEYFRAME_INTERVAL-th snapshot is a
+ * keyframe, the rest are stored as the XOR against their keyframe with
+ * unchanged 8-byte words run-length encoded, so a frame usually costs a
+ * few hundred bytes. When the budget is exceeded the oldest keyframe and
+ * its deltas are dropped.
+ */
+class Rewind {
+  public:
+    Rewind(size_t state_size, unsigned budget_mb = REWIND_BUDGET_MB,
+           unsigned keyframe_interval = REWIND_KEYFRAME_INTERVAL);
+
+    // record a snapshot of state_size bytes
+    void push(const uint8_t *state);
+
+    // restore the most recent snapshot into state and drop it from the history, false if empty
+    bool pop(uint8_t *state);
+
+    void clear();
+
+    size_t frames() const {
+        return entries.size();
+    }
+
+    size_t bytes_used() const {
+        return used;
+    }
+
+  private:
+    struct Entry {
+        bool keyframe;
+        std::vector<uint8_t> data;
+    };
+
+    size_t state_size;
+    size_t words;
+    size_t budget;
+    unsigned keyframe_interval;
+
+    std::deque<Entry> entries;
+    size_t used;
+    unsigned group_frames; // snapshots in the newest keyframe group
+
+    std::vector<uint64_t> key;     // decoded keyframe of the newest group
+    std::vector<uint64_t> scratch; // snapshot being encoded or decoded
+
+    void load(const uint8_t *state);
+
+    void encode(const uint64_t *base, std::vector<uint8_t> &out) const;
+
+    void decode(const std::vector<uint8_t> &in, const uint64_t *base, uint64_t *out) const;
+
+    void drop_oldest_group();
+};
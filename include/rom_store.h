@@ -0,0 +1,36 @@
+#pragma once
+
+#include <inttypes.h>
+#include <memory>
+#include <string>
+
+/*
+ * A ROM image loaded through RomStore. On POSIX systems the file is mapped
+ * read-only, so the pages come from the page cache and are shared with any
+ * other process running the same ROM.
+ */
+struct RomImage {
+    uint8_t *data; // read-only
+    unsigned size;
+    uint64_t hash; // FNV-1a of the contents
+
+    RomImage() = default;
+    ~RomImage();
+
+    size_t mapped_bytes = 0;
+    long long mtime     = 0; // modification time when loaded, reloaded if the file changes
+
+    RomImage(RomImage const &)      = delete;
+    void operator=(RomImage const &) = delete;
+};
+
+/*
+ * Process-wide cache of ROM images, keyed by path and by content hash, so all
+ * Carts running the same game share one copy. An image is unmapped when the last
+ * Cart using it is destroyed.
+ */
+class RomStore {
+  public:
+    // throws std::runtime_error if the file can't be read
+    static std::shared_ptr<const RomImage> load(const std::string &filename);
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SAVESTATE_MAGIC   0x53454247u // "GBES"
+#define SAVESTATE_VERSION 2u
+#define SAVESTATE_SLOTS   4u
+
+struct MachineState;
+
+/*
+ * Savestate file format. A header identifying the format version and the
+ * ROM (title and checksums) is followed by one section per component of
+ * the machine state, each tagged, sized and CRC-32 checked.
+ */
+class SaveState {
+  public:
+    // serialize a state block (MachineState layout, e.g. from gbe::save_state) of a machine running rom
+    static std::vector<uint8_t> encode(const uint8_t *state, const uint8_t *rom);
+
+    // validate data against rom and the layout of state, then apply it. On error state is untouched.
+    static bool decode(const std::vector<uint8_t> &data, MachineState &state, const uint8_t *rom);
+
+    static bool load(const std::string &filename, MachineState &state, const uint8_t *rom);
+
+    // encode and write through a temporary file, false on IO errors
+    static bool save(const std::string &filename, const uint8_t *state, const uint8_t *rom);
+
+    // file name of a numbered save slot
+    static std::string slot_filename(unsigned slot);
+
+    static uint32_t crc32(const uint8_t *data, size_t size);
+};
+
+/*
+ * Writes savestates from a background thread. save() only copies the state
+ * block, encoding and disk IO happen off the emulation thread. Files are
+ * written to a temporary name and renamed, so a slot is never half-written.
+ */
+class SaveStateWriter {
+  public:
+    SaveStateWriter();
+    ~SaveStateWriter();
+
+    SaveStateWriter(SaveStateWriter const &) = delete;
+    void operator=(SaveStateWriter const &)  = delete;
+
+    void save(const std::string &filename, const MachineState &state, const uint8_t *rom);
+
+    // block until all queued saves are on disk
+    void flush();
+
+  private:
+    struct Job {
+        std::string filename;
+        std::vector<uint8_t> state;
+        const uint8_t *rom;
+    };
+
+    std::deque<Job> jobs;
+    bool busy;
+    bool stopping;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread writer;
+
+    void writer_loop();
+};
@@ -2,28 +2,60 @@
 
 #include <functional>
 #include <inttypes.h>
+#include <string>
+#include <vector>
+
+#include "state.h"
+
+#define SERIAL_CAPTURE_BYTES 4096u
 
 class Memory;
 
 class SerialPortInterface {
   public:
     SerialPortInterface(
-        Memory &MemRef, std::function<void(uint8_t)> on_byte_send = [](uint8_t) {}
+        Memory &MemRef, SerialState &StateRef, std::function<void(uint8_t)> on_byte_send = [](uint8_t) {}
     )
-        : transfer_callback(on_byte_send), MEM(MemRef), transfer_bit(0), clock(0) {
+        : transfer_callback(on_byte_send), MEM(MemRef), transfer_bit(StateRef.transfer_bit), clock(StateRef.clock) {
+        transfer_bit = 0;
+        clock        = 0;
     }
 
     void update(unsigned tclocks);
 
+    // keep sent bytes in a buffer (at least the last max_bytes, 0: all) and watch it for patterns, e.g. test
+    // ROM verdicts
+    void capture(const std::vector<std::string> &patterns, size_t max_bytes = SERIAL_CAPTURE_BYTES);
+
+    // same capture settings and output as other, for forks
+    void copy_capture(const SerialPortInterface &other);
+
+    const std::string &captured() const {
+        return output;
+    }
+
+    // index of the first pattern that appeared in the output, -1 while none has
+    int matched() const {
+        return match;
+    }
+
   private:
     Memory &MEM;
 
     std::function<void(uint8_t)> transfer_callback;
 
-    uint8_t transfer_bit;
-    unsigned clock;
+    uint8_t &transfer_bit;
+    unsigned &clock;
+
+    bool capturing = false;
+    std::vector<std::string> patterns;
+    size_t max_bytes = 0;
+    std::string output;
+    int match = -1;
 
     void transfer();
 
+    void record(uint8_t byte);
+
     void finish();
 };
\ No newline at end of file
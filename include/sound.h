@@ -1,16 +1,23 @@
 #pragma once
 
 #include "sound_defs.h"
+#include "state.h"
 #include <inttypes.h>
+#include <string>
 #include <unordered_map>
 
 #define TCLK_HZ        4194304u
 #define SAMPLE_RATE    44000u
-#define SOUND_MEM_SIZE 48
+
+class AudioCapture;
 
 class Sound {
   public:
-    Sound();
+    Sound(SoundState &StateRef);
+    ~Sound();
+
+    Sound(Sound const &)          = delete;
+    void operator=(Sound const &) = delete;
 
     void update(unsigned tclk);
 
@@ -18,6 +25,10 @@ class Sound {
 
     void getSamples(sample_t *left, sample_t *right);
 
+    // noise channel output (true = low) at LFSR step index since trigger, 0 being the first step, from the
+    // precomputed sequences
+    static bool noiseLow(unsigned index, bool short_mode);
+
     void writeByte(uint16_t addr, uint8_t val);
     uint8_t readByte(uint16_t addr);
 
@@ -28,16 +39,34 @@ class Sound {
 
     unsigned long samples{0};
 
+    // stream generated samples to a file until stopCapture (see AudioCapture)
+    void startCapture(const std::string &filename, bool channel_stems = false);
+    void stopCapture();
+
+    // accumulate per-channel levels for getFeatures
+    bool track_features{false};
+
+    // write AUDIO_FEATURES floats, channel by channel: active (0/1), frequency register
+    // (NR43 for ch4), volume (0-1) and RMS level (0-1) over samples since the previous call
+    void getFeatures(float *out);
+
   private:
-    bool sample_ready{false};
-    unsigned clock{0};
-    sample_t lsample{0}, rsample{0};
+    AudioCapture *capture{nullptr};
+
+    float square_sums[4]{0, 0, 0, 0};
+    unsigned feature_samples{0};
+
+    SoundState &state;
+
+    bool &sample_ready;
+    unsigned &clock;
+    sample_t &lsample, &rsample;
     sample_t sample_map[16];
     sample_t square_map[33];
 
-    uint8_t mem[SOUND_MEM_SIZE];
+    uint8_t (&mem)[SOUND_MEM_SIZE];
 
-    int internal_256hz_counter{TCLK_HZ / 256};
+    int &internal_256hz_counter;
 
     sample_t updateCh1(unsigned tclock, bool length_tick);
     sample_t updateCh2(unsigned tclock, bool length_tick);
@@ -2,4 +2,10 @@
 
 #include <cstdint>
 
-typedef int16_t sample_t;
\ No newline at end of file
+typedef int16_t sample_t;
+
+#define SOUND_MEM_SIZE 48
+
+// per channel: active flag, frequency register, envelope volume, RMS level
+#define AUDIO_FEATURES_PER_CHANNEL 4u
+#define AUDIO_FEATURES             (4u * AUDIO_FEATURES_PER_CHANNEL)
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <inttypes.h>
+#include <memory>
+#include <type_traits>
+
+#include "reg.h"
+#include "sound_defs.h"
+
+#define STATE_PAGE_SIZE 256u // granularity of dirty tracking and incremental snapshots
+
+/*
+ * Mutable machine state of one emulator instance, kept in a single
+ * trivially-copyable block. Components hold references into it, so a
+ * snapshot is one memcpy of MachineState::size() bytes. Read-only data
+ * (ROM, instruction tables, lookup tables) and frontend output (LCD and
+ * debug buffers) live outside.
+ */
+
+struct CpuState {
+    bool stuck;
+};
+
+struct CartState {
+    enum controller_mode { ROM_banking, RAM_banking }; // MBC1 mode switch
+    controller_mode mbc_mode;
+
+    unsigned RTC_reg_select; // the clock registers are stored with the cartridge RAM
+    bool RTC_access;
+
+    unsigned rom_bank;
+    unsigned ram_bank;
+};
+
+struct GpuState {
+    unsigned clk;
+    bool enabled;
+};
+
+struct TimerState {
+    unsigned div_clock;
+    unsigned m_clock;
+};
+
+struct SerialState {
+    uint8_t transfer_bit;
+    unsigned clock;
+};
+
+struct SquareChannelState {
+    unsigned freq_clock;
+    unsigned ctr;
+    unsigned env_step;
+    unsigned env_ctr;
+    unsigned sweep_ctr; // channel 1 only
+    unsigned sweep_step;
+    unsigned sweep_freq;
+    uint8_t vol;
+    sample_t sample;
+};
+
+struct WaveChannelState {
+    unsigned freq_clock;
+    uint8_t index;
+    uint8_t vol;
+    sample_t sample;
+};
+
+struct NoiseChannelState {
+    unsigned freq_clock;
+    unsigned env_step;
+    unsigned env_ctr;
+    unsigned lfsr_index;
+    uint8_t vol;
+    sample_t sample;
+};
+
+struct SoundState {
+    uint8_t mem[SOUND_MEM_SIZE];
+
+    bool sample_ready;
+    unsigned clock;
+    sample_t lsample, rsample;
+    int internal_256hz_counter;
+
+    SquareChannelState ch1;
+    SquareChannelState ch2;
+    WaveChannelState ch3;
+    NoiseChannelState ch4;
+};
+
+struct MachineState {
+    // only the writable parts of the address space: ROM and external RAM are read from the cart,
+    // echo RAM mirrors WRAM and 0xFEA0 - 0xFEFF is unusable
+    uint8_t VRAM[0x2000]; // 0x8000 - 0x9FFF
+    uint8_t WRAM[0x2000]; // 0xC000 - 0xDFFF
+    uint8_t HIGH[0x200];  // 0xFE00 - 0xFFFF: OAM, IO registers, HRAM
+
+    uint8_t BIOS[0x100];
+
+    Registers REG;
+    CpuState cpu;
+    CartState cart;
+    GpuState gpu;
+    TimerState timer;
+    SerialState serial;
+    SoundState sound;
+    uint8_t buttons;
+
+    long clock_overflow;
+
+    // XOR of state_byte_key over VRAM, WRAM and cartridge memory, kept up to date by Memory on every write
+    // so state_hash() only has to read the rest of the state
+    uint64_t memory_hash;
+
+    // cartridge RAM (and the MBC3 clock registers) is stored after this struct in the same block,
+    // starting on a page boundary
+    unsigned cart_ram_size;
+
+    static size_t cart_ram_offset() {
+        return (sizeof(MachineState) + STATE_PAGE_SIZE - 1) & ~size_t(STATE_PAGE_SIZE - 1);
+    }
+
+    uint8_t *cart_ram() {
+        return reinterpret_cast<uint8_t *>(this) + cart_ram_offset();
+    }
+
+    size_t size() const {
+        return cart_ram_offset() + cart_ram_size;
+    }
+
+    // zero-initialized state with room for cart_ram_size bytes of cartridge RAM
+    static MachineState *create(unsigned cart_ram_size);
+
+    // state for a forked emulator: copies everything except the regions shared copy-on-write
+    // (VRAM, WRAM, cartridge RAM)
+    static MachineState *fork(const MachineState &parent);
+
+    // index of the first page that is not tracked by Memory::dirty
+    static unsigned untracked_page() {
+        return offsetof(MachineState, HIGH) / STATE_PAGE_SIZE;
+    }
+
+    static void destroy(MachineState *state);
+
+    // VRAM, WRAM and cartridge memory are covered by memory_hash, everything else is hashed on demand
+    bool is_hashed(size_t offset) const {
+        return offset < offsetof(MachineState, HIGH) || (offset >= cart_ram_offset() && offset < size());
+    }
+
+    // recompute memory_hash from the own storage of this state block (no regions shared with a fork)
+    void rehash();
+
+    // 64-bit hash of the whole state: equal for states that save_state identically
+    uint64_t hash() const;
+};
+
+static_assert(std::is_trivially_copyable<MachineState>::value, "machine state must be copyable with memcpy");
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9u;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBu;
+    return x ^ (x >> 31);
+}
+
+// Zobrist key of a byte value at a state offset. Zero bytes have key 0, so zeroed memory hashes to 0.
+inline uint64_t state_byte_key(size_t offset, uint8_t value) {
+    uint64_t key = mix64(((uint64_t(offset) << 8) | value) * 0x9E3779B97F4A7C15u);
+    return value ? key : 0;
+}
+
+/*
+ * A region of the machine state (VRAM, WRAM or a cartridge RAM bank) that forked
+ * emulators share read-only until one of them writes to it. data points either at
+ * the instance's own storage in its state block or at an immutable shared copy.
+ */
+struct SharedRegion {
+    uint8_t *own;
+    uint8_t *data;
+    unsigned size;
+
+    std::shared_ptr<const uint8_t[]> shared;
+
+    SharedRegion(uint8_t *storage, unsigned bytes) : own(storage), data(storage), size(bytes) {}
+
+    // pointer for writing, copies the region into own storage on first write after a fork
+    uint8_t *writable() {
+        if (shared) {
+            memcpy(own, data, size);
+            release();
+        }
+        return own;
+    }
+
+    // share the current contents with another instance's region of the same size
+    void share_with(SharedRegion &other) {
+        if (!shared) {
+            // spare byte for word reads at the region end. own may end the state block (the last cart RAM
+            // bank), so it isn't copied from there.
+            uint8_t *copy = new uint8_t[size + 1];
+            memcpy(copy, own, size);
+            copy[size] = 0;
+            shared = std::shared_ptr<const uint8_t[]>(copy);
+            data   = copy;
+        }
+        other.shared = shared;
+        other.data   = data;
+    }
+
+    // point back at own storage without copying (after it was overwritten by a state load)
+    void release() {
+        shared.reset();
+        data = own;
+    }
+};
@@ -1,10 +1,15 @@
 #pragma once
 
+#include "state.h"
+
 class Memory;
 
 class Timer {
   public:
-    Timer(Memory &MemRef) : MEM(MemRef), div_clock(0), m_clock(0) {
+    Timer(Memory &MemRef, TimerState &StateRef)
+        : MEM(MemRef), div_clock(StateRef.div_clock), m_clock(StateRef.m_clock) {
+        div_clock = 0;
+        m_clock   = 0;
     }
 
     void update(unsigned tclock);
@@ -12,8 +17,8 @@ class Timer {
   private:
     Memory &MEM;
 
-    unsigned div_clock;
-    unsigned m_clock;
+    unsigned &div_clock;
+    unsigned &m_clock;
 
     void tick();
 };
\ No newline at end of file
@@ -13,6 +13,10 @@
 
 using namespace glm;
 
+#define TURBO_FRAME_SKIP 8u // by default present every 8th frame when fast-forwarding
+#define SYNC_SLICES      4u // real-time sync points per frame, keeps audio bursts short enough for a small queue
+#define TURBO_UPDATE_CLK 456u // when fast-forwarding, cycles between window and audio output updates (a scanline)
+
 class Memory;
 class Buttons;
 class OpenAL_Output;
@@ -20,9 +24,10 @@ class Sound;
 
 class Window : public UI {
   public:
-    Window(Memory &MemRef, Buttons &BtnRef, Sound &SndRef, Gpu &GPU, bool u)
-        : MEM(MemRef), BTN(BtnRef), SND(SndRef), GPU(GPU), unlocked_frame_rate(u), game_scale(4),
-          tileset_scale(2), tilemap_scale(1), f5_down(false), f6_down(false), state({0, 0}), UI() {
+    Window(Memory &MemRef, Buttons &BtnRef, Sound &SndRef, Gpu &GPU, bool u, unsigned turbo_skip = TURBO_FRAME_SKIP)
+        : MEM(MemRef), BTN(BtnRef), SND(SndRef), GPU(GPU), unlocked_frame_rate(u), turbo_skip(turbo_skip ? turbo_skip : 1),
+          game_scale(4), tileset_scale(2), tilemap_scale(1), f5_down(false), f6_down(false), tab_down(false),
+          state({0, 0}), UI() {
         if (!glfwInit()) {
             printf("Failed to initialize GLFW\n");
             exit(1);
@@ -93,6 +98,7 @@ class Window : public UI {
   private:
     bool f5_down;
     bool f6_down;
+    bool tab_down;
 
     void draw_buffer();
 
@@ -112,6 +118,13 @@ class Window : public UI {
 
     bool unlocked_frame_rate;
 
+    unsigned turbo_skip;
+
+    void resync();
+
+    // sleep until the wall time of the emulated clock cycles
+    void pace(unsigned long long cycles);
+
     GLFWwindow *game_window;
     GLFWwindow *tilemap_window;
     GLFWwindow *tileset_window;
@@ -35,6 +35,7 @@ ext_modules = [
             'libgbe.a'
         ],
         extra_compile_args=['-fPIC'],
+        extra_link_args=['-pthread'] + (['-lrt'] if sys.platform.startswith('linux') else []),
         language='c++'
     ),
 ]
@@ -0,0 +1,155 @@
+#include "audio_capture.h"
+#include "sound.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+using namespace std;
+
+static bool has_wav_extension(const string &filename) {
+    return filename.size() >= 4 &&
+           (filename.compare(filename.size() - 4, 4, ".wav") == 0 ||
+            filename.compare(filename.size() - 4, 4, ".WAV") == 0);
+}
+
+static string stem_filename(const string &filename, unsigned channel) {
+    string suffix = "_ch" + to_string(channel);
+    size_t dot    = filename.find_last_of('.');
+    size_t slash  = filename.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return filename + suffix;
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+AudioCapture::AudioCapture(const string &filename, bool channel_stems)
+    : stems(channel_stems), frame_width(channel_stems ? 6 : 2), fill_frames(0), write_frames(0), total_frames(0),
+      pending(false), stopping(false) {
+
+    fill_block.resize(CAPTURE_BLOCK_FRAMES * frame_width);
+    write_block.resize(CAPTURE_BLOCK_FRAMES * frame_width);
+
+    vector<pair<string, unsigned>> outputs{{filename, 2}};
+    if (stems) {
+        scratch.resize(CAPTURE_BLOCK_FRAMES * 2);
+        for (unsigned ch = 1; ch <= 4; ++ch)
+            outputs.push_back({stem_filename(filename, ch), 1});
+    }
+
+    for (auto &output : outputs) {
+        FILE *file = fopen(output.first.c_str(), "wb");
+        if (file == nullptr) {
+            // the destructor doesn't run for a constructor that throws
+            for (Track &opened : tracks)
+                fclose(opened.file);
+            throw runtime_error("could not open audio capture file " + output.first);
+        }
+        setvbuf(file, nullptr, _IOFBF, CAPTURE_FILE_BUFFER);
+
+        Track track{file, output.second, 0, has_wav_extension(filename)};
+        if (track.wav)
+            write_header(track);
+        tracks.push_back(track);
+    }
+
+    writer = thread(&AudioCapture::writer_loop, this);
+}
+
+AudioCapture::~AudioCapture() {
+    if (fill_frames)
+        submit();
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+
+    for (Track &track : tracks)
+        fclose(track.file);
+}
+
+void AudioCapture::submit() {
+    unique_lock<mutex> guard(lock);
+    // only blocks if the writer has fallen a whole block behind
+    cond.wait(guard, [this] { return !pending; });
+
+    fill_block.swap(write_block);
+    write_frames = fill_frames;
+    total_frames += fill_frames;
+    fill_frames = 0;
+    pending     = true;
+
+    guard.unlock();
+    cond.notify_all();
+}
+
+void AudioCapture::writer_loop() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return pending || stopping; });
+        if (!pending)
+            break;
+
+        guard.unlock();
+        write_block_to_disk();
+        guard.lock();
+
+        pending = false;
+        cond.notify_all();
+    }
+}
+
+void AudioCapture::write_block_to_disk() {
+    for (unsigned t = 0; t < tracks.size(); ++t) {
+        Track &track = tracks[t];
+
+        const sample_t *data = write_block.data();
+        if (stems) {
+            // gather this track's columns out of the interleaved frames
+            unsigned first = (t == 0) ? 0 : t + 1;
+            sample_t *out  = scratch.data();
+            for (unsigned i = 0; i < write_frames; ++i) {
+                const sample_t *frame = &write_block[i * frame_width + first];
+                for (unsigned c = 0; c < track.channels; ++c)
+                    *out++ = frame[c];
+            }
+            data = scratch.data();
+        }
+
+        fwrite(data, sizeof(sample_t) * track.channels, write_frames, track.file);
+        track.frames += write_frames;
+
+        // keep the header valid so an interrupted run leaves a playable file
+        if (track.wav)
+            write_header(track);
+        fflush(track.file);
+    }
+}
+
+void AudioCapture::write_header(Track &track) {
+    auto put32 = [&](uint32_t v) { fwrite(&v, sizeof(v), 1, track.file); };
+    auto put16 = [&](uint16_t v) { fwrite(&v, sizeof(v), 1, track.file); };
+
+    const uint16_t block_align = uint16_t(track.channels * sizeof(sample_t));
+    const uint32_t data_size   = uint32_t(track.frames * block_align);
+
+    long end = ftell(track.file);
+    fseek(track.file, 0, SEEK_SET);
+
+    fwrite("RIFF", 1, 4, track.file);
+    put32(36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, track.file);
+    put32(16);
+    put16(1); // PCM
+    put16(uint16_t(track.channels));
+    put32(SAMPLE_RATE);
+    put32(SAMPLE_RATE * block_align);
+    put16(block_align);
+    put16(16);
+    fwrite("data", 1, 4, track.file);
+    put32(data_size);
+
+    if (end > 0)
+        fseek(track.file, end, SEEK_SET);
+}
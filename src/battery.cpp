@@ -0,0 +1,81 @@
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "battery.h"
+#include "state.h"
+
+using namespace std;
+
+string BatterySave::filename_for(const string &romfile) {
+    size_t dot   = romfile.find_last_of('.');
+    size_t slash = romfile.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return romfile + ".sav";
+    return romfile.substr(0, dot) + ".sav";
+}
+
+#ifdef _WIN32
+
+BatterySave::BatterySave(const string &, unsigned) : state(nullptr), fd(-1), mapping(nullptr), mapped_bytes(0) {
+    printf("[battery] save files are not supported on this platform\n");
+}
+
+BatterySave::~BatterySave() {}
+
+#else
+
+BatterySave::BatterySave(const string &filename, unsigned cart_ram_size)
+    : state(nullptr), fd(-1), mapping(nullptr), mapped_bytes(0) {
+
+    fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("[battery] could not open %s\n", filename.c_str());
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        printf("[battery] %s is in use, cartridge RAM will not be saved\n", filename.c_str());
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (info.st_size < cart_ram_size && ftruncate(fd, cart_ram_size) != 0)) {
+        printf("[battery] could not resize %s\n", filename.c_str());
+        return;
+    }
+
+    // reserve the whole state block so the cartridge region starts on a page boundary, with a spare zero page
+    // after it for word reads at the end of the last bank, then map the file over the cartridge region
+    size_t page   = sysconf(_SC_PAGESIZE);
+    size_t head   = (MachineState::cart_ram_offset() + page - 1) / page * page;
+    mapped_bytes  = head + (cart_ram_size + page - 1) / page * page + page;
+    mapping       = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t *cart = static_cast<uint8_t *>(mapping) + head;
+
+    if (mapping == MAP_FAILED ||
+        mmap(cart, cart_ram_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        printf("[battery] could not map %s\n", filename.c_str());
+        if (mapping != MAP_FAILED)
+            munmap(mapping, mapped_bytes);
+        mapping = nullptr;
+        return;
+    }
+
+    state                = reinterpret_cast<MachineState *>(cart - MachineState::cart_ram_offset());
+    state->cart_ram_size = cart_ram_size;
+}
+
+BatterySave::~BatterySave() {
+    if (mapping != nullptr)
+        munmap(mapping, mapped_bytes);
+    if (fd >= 0)
+        close(fd); // releases the lock
+}
+
+#endif
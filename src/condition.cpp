@@ -0,0 +1,72 @@
+#include <cassert>
+
+#include "condition.h"
+#include "mem.h"
+
+void RunCondition::add(uint16_t addr, test type, uint8_t value) {
+    tests.push_back(Test{addr, type, value});
+}
+
+void RunCondition::equals(uint16_t addr, uint8_t value) {
+    add(addr, EQUALS, value);
+}
+
+void RunCondition::changes(uint16_t addr) {
+    add(addr, CHANGES, 0);
+}
+
+void RunCondition::exceeds(uint16_t addr, uint8_t value) {
+    add(addr, EXCEEDS, value);
+}
+
+void RunCondition::bit_set(uint16_t addr, unsigned bit) {
+    assert(bit < 8);
+    add(addr, BIT_SET, bit);
+}
+
+void RunCondition::alternative() {
+    if (!tests.empty() && (group_end.empty() || group_end.back() != tests.size()))
+        group_end.push_back(tests.size());
+}
+
+void RunCondition::arm(Memory &mem) {
+    initial.resize(tests.size());
+    for (size_t i = 0; i < tests.size(); ++i)
+        initial[i] = mem.peek(tests[i].addr);
+}
+
+bool RunCondition::holds(Memory &mem) const {
+    size_t begin = 0;
+
+    for (size_t group = 0; group <= group_end.size(); ++group) {
+        size_t end = group < group_end.size() ? group_end[group] : tests.size();
+        if (begin == end)
+            break;
+
+        bool all = true;
+        for (size_t i = begin; i < end && all; ++i) {
+            const Test &t = tests[i];
+            uint8_t byte  = mem.peek(t.addr);
+
+            switch (t.type) {
+                case EQUALS:
+                    all = byte == t.value;
+                    break;
+                case CHANGES:
+                    all = byte != initial[i];
+                    break;
+                case EXCEEDS:
+                    all = byte > t.value;
+                    break;
+                case BIT_SET:
+                    all = (byte >> t.value) & 1;
+                    break;
+            }
+        }
+        if (all)
+            return true;
+
+        begin = end;
+    }
+    return false;
+}
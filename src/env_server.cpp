@@ -0,0 +1,169 @@
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "env_server.h"
+
+using namespace std;
+
+ServerChannel::ServerChannel(const string &name, void *mapping, size_t bytes, bool owner)
+    : header(static_cast<ServerHeader *>(mapping)), name(name), bytes(bytes), owner(owner) {}
+
+void ServerChannel::submit(unsigned env, uint32_t command, uint8_t buttons, uint32_t repeat) {
+    ServerSlot &s = slot(env);
+    s.command     = command;
+    s.buttons     = buttons;
+    s.repeat      = repeat;
+    s.request.fetch_add(1, memory_order_release);
+
+    atomic<uint32_t> &worker = header->submitted[worker_of(env)];
+    worker.fetch_add(1, memory_order_release);
+    wake(worker);
+}
+
+void ServerChannel::wait_all() {
+    for (unsigned env = 0; env < size(); ++env) {
+        ServerSlot &s = slot(env);
+        while (true) {
+            uint32_t completed = header->completed.load(memory_order_acquire);
+            if (s.done.load(memory_order_acquire) == s.request.load(memory_order_relaxed))
+                break;
+            wait(header->completed, completed);
+        }
+    }
+}
+
+void ServerChannel::complete(unsigned env, uint32_t status) {
+    ServerSlot &s = slot(env);
+    s.status      = status;
+    s.done.store(s.request.load(memory_order_relaxed), memory_order_release);
+
+    header->completed.fetch_add(1, memory_order_release);
+    wake(header->completed);
+}
+
+#ifdef __linux__
+
+// futex words live in memory shared between processes, so no FUTEX_PRIVATE_FLAG
+void ServerChannel::wait(atomic<uint32_t> &word, uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, nullptr, nullptr, 0);
+}
+
+void ServerChannel::wake(atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+ServerChannel *ServerChannel::create(
+    const string &name, unsigned env_count, unsigned worker_count, unsigned state_size, const uint16_t *watch,
+    unsigned value_count
+) {
+    if (worker_count == 0 || worker_count > SERVER_MAX_WORKERS || value_count > SERVER_MAX_VALUES) {
+        printf("[server] at most %u workers and %u watched addresses\n", SERVER_MAX_WORKERS, SERVER_MAX_VALUES);
+        return nullptr;
+    }
+
+    size_t slot_offset = (sizeof(ServerHeader) + 63) & ~size_t(63);
+    size_t slot_size   = ServerSlot::size_for(state_size);
+    size_t bytes       = slot_offset + slot_size * env_count;
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        printf("[server] could not create shared memory %s\n", name.c_str());
+        return nullptr;
+    }
+    if (ftruncate(fd, bytes) != 0) {
+        printf("[server] could not size shared memory %s\n", name.c_str());
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("[server] could not map shared memory %s\n", name.c_str());
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    // the new object is zero-filled, which is a valid initial state for the counters
+    ServerHeader *header = static_cast<ServerHeader *>(mapping);
+    header->env_count    = env_count;
+    header->worker_count = worker_count;
+    header->state_size   = state_size;
+    header->value_count  = value_count;
+    header->slot_size    = slot_size;
+    header->slot_offset  = slot_offset;
+    memcpy(header->watch, watch, value_count * sizeof(uint16_t));
+    header->version = SERVER_VERSION;
+
+    // written last, a client attaching early sees an incomplete header as not a server
+    atomic_thread_fence(memory_order_release);
+    header->magic = SERVER_MAGIC;
+
+    return new ServerChannel(name, mapping, bytes, true);
+}
+
+ServerChannel *ServerChannel::attach(const string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        printf("[server] no server at %s\n", name.c_str());
+        return nullptr;
+    }
+
+    struct stat info;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(ServerHeader))
+        mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("[server] could not map shared memory %s\n", name.c_str());
+        return nullptr;
+    }
+
+    ServerHeader *header = static_cast<ServerHeader *>(mapping);
+    if (header->magic != SERVER_MAGIC || header->version != SERVER_VERSION) {
+        printf("[server] %s is not a compatible server\n", name.c_str());
+        munmap(mapping, info.st_size);
+        return nullptr;
+    }
+
+    return new ServerChannel(name, mapping, info.st_size, false);
+}
+
+ServerChannel::~ServerChannel() {
+    munmap(header, bytes);
+    if (owner)
+        shm_unlink(name.c_str());
+}
+
+#else
+
+void ServerChannel::wait(atomic<uint32_t> &word, uint32_t value) {
+    while (word.load() == value)
+        this_thread::yield();
+}
+
+void ServerChannel::wake(atomic<uint32_t> &) {}
+
+ServerChannel *ServerChannel::create(const string &, unsigned, unsigned, unsigned, const uint16_t *, unsigned) {
+    printf("[server] shared memory servers are not supported on this platform\n");
+    return nullptr;
+}
+
+ServerChannel *ServerChannel::attach(const string &) {
+    printf("[server] shared memory servers are not supported on this platform\n");
+    return nullptr;
+}
+
+ServerChannel::~ServerChannel() {}
+
+#endif
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "frame_pipeline.h"
+#include "gbe.h"
+
+using namespace std;
+
+// shades as gray levels, the same as display()
+static const uint8_t gray_levels[4]  = {255, 192, 96, 0};
+static const uint8_t shade_levels[4] = {0, 1, 2, 3};
+
+FramePipeline::FramePipeline(
+    unsigned crop_top, unsigned crop_left, unsigned crop_height, unsigned crop_width, unsigned height,
+    unsigned width, bool grayscale, unsigned stack
+)
+    : height(height), width(width), stack(stack), grayscale(grayscale), crop_top(crop_top), crop_left(crop_left),
+      crop_height(crop_height), crop_width(crop_width), rows(make_axis(crop_height, height)), columns(make_axis(crop_width, width)),
+      frames(size_t(stack) * height * width), newest(0), cropped(size_t(crop_height) * crop_width),
+      column_sums(crop_width) {
+
+    assert(crop_height > 0 && crop_top + crop_height <= LCD_H);
+    assert(crop_width > 0 && crop_left + crop_width <= LCD_W);
+    assert(height > 0 && width > 0 && stack > 0);
+}
+
+FramePipeline::Axis FramePipeline::make_axis(unsigned in, unsigned out) {
+    Axis axis;
+
+    // output pixel i covers source positions [i * in, (i + 1) * in) in units of 1 / out source pixels
+    axis.taps = 1;
+    for (unsigned i = 0; i < out; ++i) {
+        unsigned begin = i * in / out, end = ((i + 1) * in + out - 1) / out;
+        axis.taps      = max(axis.taps, end - begin);
+    }
+    axis.taps = min(axis.taps, in);
+
+    axis.first.resize(out);
+    axis.weights.assign(size_t(out) * axis.taps, 0);
+
+    for (unsigned i = 0; i < out; ++i) {
+        unsigned lo = i * in, hi = (i + 1) * in;
+        unsigned first = min(lo / out, in - axis.taps);
+
+        axis.first[i] = first;
+
+        // cumulative rounding, so the weights of each output pixel add up to exactly 256
+        unsigned covered = 0, assigned = 0;
+        for (unsigned k = 0; k < axis.taps; ++k) {
+            unsigned p_lo = (first + k) * out, p_hi = p_lo + out;
+            if (p_hi > lo && p_lo < hi)
+                covered += min(p_hi, hi) - max(p_lo, lo);
+
+            unsigned total = (covered * 256 + in / 2) / in;
+
+            axis.weights[i * axis.taps + k] = total - assigned;
+            assigned                        = total;
+        }
+    }
+    return axis;
+}
+
+void FramePipeline::process(const uint8_t *shades, uint8_t *out) {
+    const uint8_t *levels = grayscale ? gray_levels : shade_levels;
+    const uint8_t l0 = levels[0], l1 = levels[1], l2 = levels[2], l3 = levels[3];
+
+    // members are copied to locals: byte stores may alias them, which would keep the loops from vectorizing
+    const unsigned in_width = crop_width, out_width = width, row_taps = rows.taps, column_taps = columns.taps;
+    uint8_t *crop  = cropped.data();
+    uint16_t *sums = column_sums.data();
+
+    // selects rather than a table lookup, so the loop vectorizes
+    for (unsigned y = 0; y < crop_height; ++y) {
+        const uint8_t *src = &shades[(crop_top + y) * LCD_W + crop_left];
+        uint8_t *dst       = &crop[y * in_width];
+        for (unsigned x = 0; x < in_width; ++x) {
+            uint8_t shade = src[x];
+            dst[x]        = shade == 0 ? l0 : shade == 1 ? l1 : shade == 2 ? l2 : l3;
+        }
+    }
+
+    // vertical pass first: its inner loops run along contiguous rows, and the horizontal pass then only
+    // runs once per output row
+    for (unsigned y = 0; y < height; ++y) {
+        const uint8_t *src = &crop[rows.first[y] * in_width];
+        const uint16_t *w  = &rows.weights[y * row_taps];
+
+        for (unsigned x = 0; x < in_width; ++x)
+            sums[x] = w[0] * src[x];
+        for (unsigned k = 1; k < row_taps; ++k) {
+            const uint8_t *line = &src[k * in_width];
+            uint16_t weight     = w[k];
+            for (unsigned x = 0; x < in_width; ++x)
+                sums[x] += weight * line[x];
+        }
+
+        uint8_t *dst = &out[y * out_width];
+        for (unsigned x = 0; x < out_width; ++x) {
+            const uint16_t *in = &sums[columns.first[x]];
+            const uint16_t *v  = &columns.weights[x * column_taps];
+            uint32_t sum       = 0x8000;
+            for (unsigned k = 0; k < column_taps; ++k)
+                sum += v[k] * uint32_t(in[k]);
+            dst[x] = sum >> 16;
+        }
+    }
+}
+
+void FramePipeline::push(const uint8_t *shades) {
+    newest = (newest + 1) % stack;
+    process(shades, &frames[newest * frame_size()]);
+}
+
+void FramePipeline::fill(const uint8_t *shades) {
+    process(shades, &frames[0]);
+    for (unsigned i = 1; i < stack; ++i)
+        memcpy(&frames[i * frame_size()], &frames[0], frame_size());
+    newest = 0;
+}
+
+void FramePipeline::write(uint8_t *out) const {
+    for (unsigned i = 1; i <= stack; ++i) {
+        memcpy(out, &frames[(newest + i) % stack * frame_size()], frame_size());
+        out += frame_size();
+    }
+}
@@ -1,26 +1,57 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
 #include "gbe.h"
 
+#include "battery.h"
 #include "buttons.h"
 #include "cart.h"
+#include "condition.h"
 #include "cpu.h"
+#include "frame_pipeline.h"
 #include "gpu.h"
 #include "mem.h"
+#include "observation.h"
 #include "reg.h"
+#include "savestate.h"
 #include "serial.h"
 #include "sound.h"
+#include "state.h"
 #include "timer.h"
 
-gbe::gbe(std::string romfile, std::function<void(uint8_t)> serial_send_cb) : clock_overflow(0) {
+gbe::gbe(std::string romfile, std::function<void(uint8_t)> serial_send_cb, bool battery_save)
+    : romfile(romfile), serial_send_cb(serial_send_cb) {
 
-    BTN    = new Buttons();
-    SND    = new Sound();
-    REG    = new Registers();
-    CART   = new Cart(romfile);
-    MEM    = new Memory(*CART, *BTN, *SND);
-    GPU    = new Gpu(*MEM);
-    TIMER  = new Timer(*MEM);
-    CPU    = new Cpu(*MEM, *REG);
-    SERIAL = new SerialPortInterface(*MEM, serial_send_cb);
+    auto rom = RomStore::load(romfile);
+    Cart::check_header(*rom);
+    unsigned cart_ram_size = Cart::state_size_of(rom->data);
+
+    if (battery_save && cart_ram_size && Cart::has_battery(rom->data)) {
+        BATTERY = new BatterySave(BatterySave::filename_for(romfile), cart_ram_size);
+        STATE   = BATTERY->state;
+        if (STATE == nullptr) {
+            delete BATTERY;
+            BATTERY = nullptr;
+        }
+    }
+    if (BATTERY == nullptr)
+        STATE = MachineState::create(cart_ram_size);
+    else
+        STATE->rehash(); // cartridge RAM loaded from the save file
+
+    BTN    = new Buttons(STATE->buttons);
+    SND    = new Sound(STATE->sound);
+    REG    = &STATE->REG;
+    CART   = new Cart(rom, STATE->cart, STATE->cart_ram());
+    MEM    = new Memory(*CART, *BTN, *SND, *STATE);
+    GPU    = new Gpu(*MEM, STATE->gpu);
+    TIMER  = new Timer(*MEM, STATE->timer);
+    CPU    = new Cpu(*MEM, *REG, STATE->cpu);
+    SERIAL = new SerialPortInterface(*MEM, STATE->serial, serial_send_cb);
 
     REG->AF = 0x01B0;
     REG->BC = 0x0013;
@@ -33,49 +64,96 @@ gbe::gbe(std::string romfile, std::function<void(uint8_t)> serial_send_cb) : clo
 
     // enable LCD
     *MEM->LCD_CTRL = 0x80;
+
+    // the power-on state only depends on the ROM, unless cartridge RAM was loaded from a save file
+    if (BATTERY) {
+        set_reset_state();
+        return;
+    }
+
+    static std::mutex power_on_lock;
+    static std::map<const RomImage *, std::weak_ptr<const std::vector<uint8_t>>> power_on_states;
+
+    std::lock_guard<std::mutex> guard(power_on_lock);
+    reset_state = power_on_states[rom.get()].lock();
+    if (!reset_state) {
+        set_reset_state();
+        power_on_states[rom.get()] = reset_state;
+    }
+}
+
+gbe::~gbe() {
+    delete SERIAL;
+    delete CPU;
+    delete TIMER;
+    delete GPU;
+    delete MEM;
+    delete CART;
+    delete SND;
+    delete BTN;
+    delete SCHEMA;
+    delete PIPELINE;
+    if (BATTERY)
+        delete BATTERY;
+    else
+        MachineState::destroy(STATE);
 }
 
 uint8_t *gbe::display() {
-    return GPU->lcd_buffer.data();
+    return GPU->lcd_rgb();
 }
 
-bool gbe::run(long clock_cycles) {
+const uint8_t *gbe::screen() const {
+    return GPU->lcd_shades();
+}
 
-    clock_cycles += clock_overflow;
+long gbe::step_instruction(bool &new_frame) {
+    uint8_t opcode         = MEM->readByte(REG->PC);
+    Cpu::Instruction instr = CPU->instructions[opcode];
 
-    while (clock_cycles > 0) {
+    if (!REG->HALT) {
+        REG->PC += 1;
+        instr.fn(*CPU);
+    } else {
+        REG->TCLK = 4;
+    }
 
-        uint8_t opcode         = MEM->readByte(REG->PC);
-        Cpu::Instruction instr = CPU->instructions[opcode];
+    bool was_vblank = (*MEM->LCD_STAT & MODE_MASK) != MODE_VBLANK;
 
-        if (!REG->HALT) {
-            REG->PC += 1;
-            instr.fn(*CPU);
-        } else {
-            REG->TCLK = 4;
-        }
+    GPU->update(REG->TCLK);
+    TIMER->update(REG->TCLK);
+    SERIAL->update(REG->TCLK);
+    SND->update(REG->TCLK);
 
+    long cycles = REG->TCLK;
+
+    REG->TCLK = 0;
+    CPU->handle_interrupts();
+
+    if (REG->TCLK != 0) {
         GPU->update(REG->TCLK);
         TIMER->update(REG->TCLK);
         SERIAL->update(REG->TCLK);
         SND->update(REG->TCLK);
+    }
 
-        clock_cycles -= REG->TCLK;
+    cycles += REG->TCLK;
 
-        REG->TCLK = 0;
-        CPU->handle_interrupts();
+    bool is_vblank = (*MEM->LCD_STAT & MODE_MASK) != MODE_VBLANK;
+    new_frame      = !was_vblank && is_vblank;
 
-        if (REG->TCLK != 0) {
-            GPU->update(REG->TCLK);
-            TIMER->update(REG->TCLK);
-            SERIAL->update(REG->TCLK);
-            SND->update(REG->TCLK);
-        }
+    return cycles;
+}
 
-        clock_cycles -= REG->TCLK;
-    }
+bool gbe::run(long clock_cycles) {
+
+    clock_cycles += STATE->clock_overflow;
+
+    bool new_frame;
+    while (clock_cycles > 0)
+        clock_cycles -= step_instruction(new_frame);
 
-    clock_overflow = clock_cycles;
+    STATE->clock_overflow = clock_cycles;
 
     return !CPU->is_stuck();
 }
@@ -83,65 +161,451 @@ bool gbe::run(long clock_cycles) {
 bool gbe::run_to_vblank() {
 
     while (true) {
+        bool new_frame;
+        step_instruction(new_frame);
 
-        uint8_t opcode         = MEM->readByte(REG->PC);
-        Cpu::Instruction instr = CPU->instructions[opcode];
-
-        if (!REG->HALT) {
-            REG->PC += 1;
-            instr.fn(*CPU);
-        } else {
-            REG->TCLK = 4;
+        // run until vblank triggered
+        if (new_frame) {
+            gather_values();
+            return true;
         }
+        if (CPU->is_stuck())
+            return false;
+    }
+}
 
-        bool was_vblank = (*MEM->LCD_STAT & MODE_MASK) != MODE_VBLANK;
+gbe::run_result gbe::run_until(RunCondition &condition, long max_cycles, unsigned max_frames) {
+    condition.arm(*MEM);
 
-        GPU->update(REG->TCLK);
-        TIMER->update(REG->TCLK);
-        SERIAL->update(REG->TCLK);
-        SND->update(REG->TCLK);
+    unsigned frames = 0;
+    uint8_t line    = *MEM->SCAN_LN;
 
-        REG->TCLK = 0;
-        CPU->handle_interrupts();
+    while (max_cycles > 0) {
+        bool new_frame;
+        max_cycles -= step_instruction(new_frame);
 
-        if (REG->TCLK != 0) {
-            GPU->update(REG->TCLK);
-            TIMER->update(REG->TCLK);
-            SERIAL->update(REG->TCLK);
-            SND->update(REG->TCLK);
+        if (new_frame) {
+            gather_values();
+            ++frames;
         }
 
-        bool is_vblank = (*MEM->LCD_STAT & MODE_MASK) != MODE_VBLANK;
+        bool check;
+        switch (condition.check_every) {
+            case RunCondition::INSTRUCTION:
+                check = true;
+                break;
+            case RunCondition::SCANLINE:
+                check = *MEM->SCAN_LN != line;
+                line  = *MEM->SCAN_LN;
+                break;
+            default:
+                check = new_frame;
+                break;
+        }
 
-        // run until vblank triggered
-        if (!was_vblank && is_vblank)
-            return true;
+        if (check && condition.holds(*MEM)) {
+            gather_values();
+            return CONDITION_MET;
+        }
         if (CPU->is_stuck())
-            return false;
+            return STUCK;
+        if (max_frames && frames >= max_frames)
+            return TIMEOUT;
     }
+    gather_values();
+    return TIMEOUT;
 }
 
-void gbe::input(bool up, bool down, bool left, bool right, bool a, bool b, bool start, bool select) {
-    BTN->state = 0;
+uint8_t gbe::button_mask(bool up, bool down, bool left, bool right, bool a, bool b, bool start, bool select) {
+    uint8_t mask = 0;
 
     if (up)
-        BTN->state |= KEY_UP;
+        mask |= KEY_UP;
     if (down)
-        BTN->state |= KEY_DOWN;
+        mask |= KEY_DOWN;
     if (left)
-        BTN->state |= KEY_LEFT;
+        mask |= KEY_LEFT;
     if (right)
-        BTN->state |= KEY_RIGHT;
+        mask |= KEY_RIGHT;
     if (start)
-        BTN->state |= KEY_START;
+        mask |= KEY_START;
     if (select)
-        BTN->state |= KEY_SELECT;
+        mask |= KEY_SELECT;
     if (a)
-        BTN->state |= KEY_A;
+        mask |= KEY_A;
     if (b)
-        BTN->state |= KEY_B;
+        mask |= KEY_B;
+
+    return mask;
+}
+
+void gbe::input(bool up, bool down, bool left, bool right, bool a, bool b, bool start, bool select) {
+    BTN->state = button_mask(up, down, left, right, a, b, start, select);
+}
+
+void gbe::configure_step(bool max_pool, double sticky_prob, uint64_t seed) {
+    pool_frames       = max_pool;
+    this->sticky_prob = sticky_prob;
+    rng_state         = seed;
+}
+
+// uniform in [0, 1), splitmix64
+double gbe::next_random() {
+    uint64_t x = (rng_state += 0x9E3779B97F4A7C15u);
+    x          = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9u;
+    x          = (x ^ (x >> 27)) * 0x94D049BB133111EBu;
+    x ^= x >> 31;
+    return (x >> 11) * 0x1.0p-53;
+}
+
+bool gbe::step(uint8_t buttons, unsigned repeat) {
+    bool running = true;
+
+    for (unsigned frame = 0; frame < repeat && running; ++frame) {
+        // a sticky frame keeps the buttons the game saw on the previous frame
+        if (sticky_prob <= 0 || next_random() >= sticky_prob)
+            BTN->state = buttons;
+        running = run_to_vblank();
+    }
+
+    if (pool_frames) {
+        // right after vblank the back buffer still holds the previous frame
+        pooled.resize(LCD_W * LCD_H);
+        const uint8_t *current  = GPU->lcd_shades();
+        const uint8_t *previous = GPU->lcd_previous_shades();
+        for (unsigned i = 0; i < LCD_W * LCD_H; ++i)
+            pooled[i] = std::max(current[i], previous[i]);
+    }
+    if (PIPELINE)
+        PIPELINE->push(observation());
+
+    return running;
+}
+
+std::future<bool> gbe::step_async(uint8_t buttons, unsigned repeat) {
+    return std::async(std::launch::async, [this, buttons, repeat] { return step(buttons, repeat); });
+}
+
+const uint8_t *gbe::observation() const {
+    return pool_frames ? pooled.data() : screen();
+}
+
+void gbe::configure_observation(const FramePipeline *pipeline) {
+    delete PIPELINE;
+    PIPELINE = nullptr;
+
+    if (pipeline) {
+        PIPELINE = new FramePipeline(*pipeline);
+        PIPELINE->fill(screen());
+    }
+}
+
+size_t gbe::observation_size() const {
+    return PIPELINE ? PIPELINE->size() : LCD_W * LCD_H;
+}
+
+void gbe::write_observation(uint8_t *out) const {
+    if (PIPELINE)
+        PIPELINE->write(out);
+    else
+        memcpy(out, observation(), LCD_W * LCD_H);
+}
+
+void gbe::capture_serial(const std::vector<std::string> &patterns, size_t max_bytes) {
+    SERIAL->capture(patterns, max_bytes);
+}
+
+const std::string &gbe::serial_output() const {
+    return SERIAL->captured();
+}
+
+int gbe::serial_match() const {
+    return SERIAL->matched();
 }
 
 uint8_t gbe::mem(uint16_t addr) {
     return MEM->readByte(addr);
 }
+
+void gbe::read_memory(uint16_t addr, uint8_t *out, size_t count) {
+    MEM->read_range(addr, out, count);
+}
+
+void gbe::set_observation_schema(const ObservationSchema &schema) {
+    delete SCHEMA;
+    SCHEMA = nullptr;
+    schema_values.clear();
+
+    if (schema.size() > 0) {
+        SCHEMA = new ObservationSchema(schema);
+        SCHEMA->compile();
+        schema_values.resize(SCHEMA->size());
+        gather_values();
+    }
+}
+
+void gbe::gather_values() {
+    if (SCHEMA)
+        SCHEMA->gather(*MEM, schema_values.data());
+}
+
+gbe *gbe::fork() {
+    gbe *child = new gbe();
+
+    child->romfile        = romfile;
+    child->serial_send_cb = serial_send_cb;
+    child->STATE          = MachineState::fork(*STATE);
+
+    MachineState *CHILD = child->STATE;
+
+    // construct components over the copied state, then restore the values their constructors reset
+    uint8_t saved[sizeof(MachineState) - offsetof(MachineState, BIOS)];
+    memcpy(saved, CHILD->BIOS, sizeof(saved));
+
+    child->BTN    = new Buttons(CHILD->buttons);
+    child->SND    = new Sound(CHILD->sound);
+    child->REG    = &CHILD->REG;
+    child->CART   = new Cart(*CART, CHILD->cart, CHILD->cart_ram());
+    child->MEM    = new Memory(*child->CART, *child->BTN, *child->SND, *CHILD);
+    child->GPU    = new Gpu(*child->MEM, CHILD->gpu);
+    child->TIMER  = new Timer(*child->MEM, CHILD->timer);
+    child->CPU    = new Cpu(*child->MEM, *child->REG, CHILD->cpu);
+    child->SERIAL = new SerialPortInterface(*child->MEM, CHILD->serial, child->serial_send_cb);
+
+    memcpy(CHILD->BIOS, saved, sizeof(saved));
+
+    child->SERIAL->copy_capture(*SERIAL);
+
+    child->MEM->break_addr = MEM->break_addr;
+    child->reset_state     = reset_state;
+    child->pool_frames     = pool_frames;
+    child->sticky_prob     = sticky_prob;
+    child->rng_state       = rng_state;
+    child->pooled          = pooled;
+    child->schema_values   = schema_values;
+    if (SCHEMA)
+        child->SCHEMA = new ObservationSchema(*SCHEMA);
+    if (PIPELINE)
+        child->PIPELINE = new FramePipeline(*PIPELINE);
+    MEM->share_with(*child->MEM);
+
+    return child;
+}
+
+size_t gbe::state_size() const {
+    return STATE->size();
+}
+
+void gbe::save_state(uint8_t *buffer) const {
+    memcpy(buffer, STATE, STATE->size());
+
+    // regions still shared with a fork parent are not in the state block
+    auto gather = [&](const SharedRegion &region) {
+        if (region.shared)
+            memcpy(buffer + (region.own - reinterpret_cast<uint8_t *>(STATE)), region.data, region.size);
+    };
+    gather(MEM->VRAM);
+    gather(MEM->WRAM);
+    for (const SharedRegion &bank : CART->RAM_BANKS)
+        gather(bank);
+}
+
+void gbe::load_state(const uint8_t *buffer) {
+    // the layout depends on the cartridge RAM size, a state from another ROM would overrun the state block
+    if (reinterpret_cast<const MachineState *>(buffer)->cart_ram_size != STATE->cart_ram_size)
+        throw std::invalid_argument("state does not match the ROM's cartridge RAM size");
+    memcpy(STATE, buffer, STATE->size());
+    MEM->release_shared();
+    MEM->mark_all_dirty();
+    gather_values();
+}
+
+uint64_t gbe::rom_hash() const {
+    return CART->rom_image().hash;
+}
+
+void gbe::restore(const uint8_t *buffer) {
+    if (BATTERY == nullptr) {
+        load_state(buffer);
+        return;
+    }
+
+    // cartridge RAM is the mapped save file, keep it instead of overwriting the player's save
+    memcpy(STATE, buffer, MachineState::cart_ram_offset());
+    MEM->release_shared();
+    STATE->rehash();
+    MEM->mark_all_dirty();
+    gather_values();
+}
+
+void gbe::reset() {
+    restore(reset_state->data());
+    if (PIPELINE)
+        PIPELINE->fill(screen());
+}
+
+void gbe::set_reset_state() {
+    auto state = std::make_shared<std::vector<uint8_t>>(state_size());
+    save_state(state->data());
+    reset_state = state;
+}
+
+void gbe::warm_start(unsigned idle_frames, const std::string &cache_dir) {
+    std::string cache_file;
+
+    if (!cache_dir.empty()) {
+        char name[40];
+        snprintf(
+            name, sizeof(name), "/%016llx_%u.state", (unsigned long long)CART->rom_image().hash, idle_frames
+        );
+        cache_file = cache_dir + name;
+
+        FILE *file = fopen(cache_file.c_str(), "rb");
+        if (file != nullptr) {
+            fclose(file);
+            MachineState *cached = MachineState::create(STATE->cart_ram_size);
+            bool loaded          = SaveState::load(cache_file, *cached, CART->ROM);
+            if (loaded) {
+                restore(reinterpret_cast<const uint8_t *>(cached));
+                set_reset_state();
+            }
+            MachineState::destroy(cached);
+            if (loaded)
+                return;
+        }
+    }
+
+    reset();
+    input(false, false, false, false, false, false, false, false);
+    for (unsigned frame = 0; frame < idle_frames; ++frame)
+        run_to_vblank();
+    set_reset_state();
+
+    if (!cache_file.empty())
+        SaveState::save(cache_file, reset_state->data(), CART->ROM);
+}
+
+const uint8_t *gbe::page(unsigned index) const {
+    size_t offset = size_t(index) * STATE_PAGE_SIZE;
+
+    size_t cart = offset - MachineState::cart_ram_offset();
+    if (offset >= MachineState::cart_ram_offset() && cart / 0x2000 < CART->RAM_BANKS.size())
+        return &CART->RAM_BANKS[cart / 0x2000].data[cart % 0x2000];
+    if (offset < offsetof(MachineState, WRAM))
+        return &MEM->VRAM.data[offset];
+    if (offset < offsetof(MachineState, HIGH))
+        return &MEM->WRAM.data[offset - offsetof(MachineState, WRAM)];
+    return reinterpret_cast<const uint8_t *>(STATE) + offset;
+}
+
+uint8_t *gbe::writable_page(unsigned index) {
+    size_t offset = size_t(index) * STATE_PAGE_SIZE;
+
+    size_t cart = offset - MachineState::cart_ram_offset();
+    if (offset >= MachineState::cart_ram_offset() && cart / 0x2000 < CART->RAM_BANKS.size())
+        return &CART->RAM_BANKS[cart / 0x2000].writable()[cart % 0x2000];
+    if (offset < offsetof(MachineState, WRAM))
+        return &MEM->VRAM.writable()[offset];
+    if (offset < offsetof(MachineState, HIGH))
+        return &MEM->WRAM.writable()[offset - offsetof(MachineState, WRAM)];
+    return reinterpret_cast<uint8_t *>(STATE) + offset;
+}
+
+uint64_t gbe::state_hash() const {
+    return STATE->hash();
+}
+
+void gbe::checkpoint() {
+    MEM->clear_dirty();
+}
+
+std::vector<unsigned> gbe::dirty_pages() const {
+    std::vector<unsigned> pages;
+
+    unsigned untracked = MachineState::untracked_page();
+    for (unsigned p = 0; p < untracked; ++p)
+        if (MEM->is_dirty(p))
+            pages.push_back(p);
+
+    // OAM, IO, HRAM, registers and component state are not tracked
+    unsigned cart_page = MachineState::cart_ram_offset() / STATE_PAGE_SIZE;
+    for (unsigned p = untracked; p < cart_page; ++p)
+        pages.push_back(p);
+
+    for (unsigned p = 0; p < STATE->cart_ram_size / STATE_PAGE_SIZE; ++p)
+        if (CART->is_dirty(p))
+            pages.push_back(cart_page + p);
+
+    return pages;
+}
+
+std::vector<unsigned> gbe::diff_pages(const uint8_t *a, const uint8_t *b) const {
+    std::vector<unsigned> pages;
+
+    for (unsigned p = 0; p < STATE->size() / STATE_PAGE_SIZE; ++p)
+        if (memcmp(a + p * STATE_PAGE_SIZE, b + p * STATE_PAGE_SIZE, STATE_PAGE_SIZE))
+            pages.push_back(p);
+
+    return pages;
+}
+
+// incremental snapshot layout: page count, page indices, page contents
+size_t gbe::max_dirty_state_size() const {
+    size_t pages = STATE->size() / STATE_PAGE_SIZE;
+    return sizeof(uint32_t) + pages * (sizeof(uint32_t) + STATE_PAGE_SIZE);
+}
+
+size_t gbe::save_dirty_state(uint8_t *buffer) const {
+    std::vector<unsigned> pages = dirty_pages();
+
+    uint32_t count = pages.size();
+    memcpy(buffer, &count, sizeof(uint32_t));
+
+    uint8_t *index = buffer + sizeof(uint32_t);
+    uint8_t *data  = index + count * sizeof(uint32_t);
+    for (uint32_t p : pages) {
+        memcpy(index, &p, sizeof(uint32_t));
+        memcpy(data, page(p), STATE_PAGE_SIZE);
+        index += sizeof(uint32_t);
+        data += STATE_PAGE_SIZE;
+    }
+
+    return data - buffer;
+}
+
+void gbe::load_dirty_state(const uint8_t *buffer) {
+    uint32_t count;
+    memcpy(&count, buffer, sizeof(uint32_t));
+
+    const uint8_t *index = buffer + sizeof(uint32_t);
+    const uint8_t *data  = index + count * sizeof(uint32_t);
+    unsigned cart_page   = MachineState::cart_ram_offset() / STATE_PAGE_SIZE;
+
+    for (uint32_t i = 0; i < count; ++i, index += sizeof(uint32_t), data += STATE_PAGE_SIZE) {
+        uint32_t p;
+        memcpy(&p, index, sizeof(uint32_t));
+        memcpy(writable_page(p), data, STATE_PAGE_SIZE);
+
+        if (p < MachineState::untracked_page())
+            MEM->mark_dirty(p);
+        else if (p >= cart_page)
+            CART->mark_dirty(p - cart_page);
+    }
+    gather_values();
+}
+
+void gbe::record_audio(std::string filename, bool channel_stems) {
+    SND->startCapture(filename, channel_stems);
+}
+
+void gbe::stop_recording() {
+    SND->stopCapture();
+}
+
+void gbe::track_audio_features(bool enable) {
+    SND->track_features = enable;
+}
+
+void gbe::audio_features(float *out) {
+    SND->getFeatures(out);
+}
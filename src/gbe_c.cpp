@@ -0,0 +1,167 @@
+#include "buttons.h"
+#include "gbe.h"
+#include "gbe_c.h"
+#include "gbe_pool.h"
+
+// the handles are the C++ objects themselves
+static gbe *unwrap(gbe_instance *instance) {
+    return reinterpret_cast<gbe *>(instance);
+}
+
+static const gbe *unwrap(const gbe_instance *instance) {
+    return reinterpret_cast<const gbe *>(instance);
+}
+
+static gbe_instance *wrap(gbe *instance) {
+    return reinterpret_cast<gbe_instance *>(instance);
+}
+
+static GbePool *unwrap(gbe_pool *pool) {
+    return reinterpret_cast<GbePool *>(pool);
+}
+
+static const GbePool *unwrap(const gbe_pool *pool) {
+    return reinterpret_cast<const GbePool *>(pool);
+}
+
+static_assert(GBE_KEY_RIGHT == KEY_RIGHT && GBE_KEY_LEFT == KEY_LEFT && GBE_KEY_UP == KEY_UP &&
+                  GBE_KEY_DOWN == KEY_DOWN && GBE_KEY_A == KEY_A && GBE_KEY_B == KEY_B &&
+                  GBE_KEY_SELECT == KEY_SELECT && GBE_KEY_START == KEY_START,
+              "C API button bits must match the emulator's");
+static_assert(GBE_LCD_W == LCD_W && GBE_LCD_H == LCD_H, "C API screen size must match the emulator's");
+
+// C callers can't catch C++ exceptions: an entry point that throws returns failed instead
+template <typename F>
+static auto guarded(F body, decltype(body()) failed) -> decltype(body()) {
+    try {
+        return body();
+    } catch (...) {
+        return failed;
+    }
+}
+
+// for entry points without a result, a failed call does nothing
+template <typename F>
+static void guarded(F body) {
+    try {
+        body();
+    } catch (...) {
+    }
+}
+
+unsigned gbe_api_version(void) {
+    return GBE_C_API_VERSION;
+}
+
+gbe_instance *gbe_create(const char *romfile) {
+    return guarded([&] { return wrap(new gbe(romfile)); }, nullptr);
+}
+
+void gbe_destroy(gbe_instance *instance) {
+    guarded([&] { delete unwrap(instance); });
+}
+
+gbe_instance *gbe_fork(gbe_instance *instance) {
+    return guarded([&] { return wrap(unwrap(instance)->fork()); }, nullptr);
+}
+
+void gbe_set_input(gbe_instance *instance, uint8_t buttons) {
+    guarded([&] {
+        unwrap(instance)->input(
+            buttons & KEY_UP, buttons & KEY_DOWN, buttons & KEY_LEFT, buttons & KEY_RIGHT, buttons & KEY_A,
+            buttons & KEY_B, buttons & KEY_START, buttons & KEY_SELECT
+        );
+    });
+}
+
+int gbe_run_frames(gbe_instance *instance, unsigned frames) {
+    return guarded(
+        [&] {
+            gbe *g       = unwrap(instance);
+            bool running = true;
+            for (unsigned frame = 0; frame < frames && running; ++frame)
+                running = g->run_to_vblank();
+            return int(running);
+        },
+        0
+    );
+}
+
+int gbe_step(gbe_instance *instance, uint8_t buttons, unsigned repeat) {
+    return guarded([&] { return int(unwrap(instance)->step(buttons, repeat)); }, 0);
+}
+
+const uint8_t *gbe_framebuffer(const gbe_instance *instance) {
+    return guarded([&] { return unwrap(instance)->screen(); }, nullptr);
+}
+
+const uint8_t *gbe_framebuffer_rgb(gbe_instance *instance) {
+    return guarded([&] { return unwrap(instance)->display(); }, nullptr);
+}
+
+void gbe_read_memory(gbe_instance *instance, uint16_t addr, uint8_t *out, size_t count) {
+    guarded([&] { unwrap(instance)->read_memory(addr, out, count); });
+}
+
+size_t gbe_state_size(const gbe_instance *instance) {
+    return guarded([&] { return unwrap(instance)->state_size(); }, 0);
+}
+
+void gbe_save_state(const gbe_instance *instance, uint8_t *buffer) {
+    guarded([&] { unwrap(instance)->save_state(buffer); });
+}
+
+int gbe_load_state(gbe_instance *instance, const uint8_t *buffer, size_t size) {
+    return guarded(
+        [&] {
+            gbe *g = unwrap(instance);
+            if (size != g->state_size())
+                return 0;
+            g->load_state(buffer); // throws on a cartridge RAM size mismatch
+            return 1;
+        },
+        0
+    );
+}
+
+void gbe_reset(gbe_instance *instance) {
+    guarded([&] { unwrap(instance)->reset(); });
+}
+
+uint64_t gbe_state_hash(const gbe_instance *instance) {
+    return guarded([&] { return unwrap(instance)->state_hash(); }, 0);
+}
+
+gbe_pool *gbe_pool_create(const char *romfile, unsigned count, unsigned threads) {
+    return guarded([&] { return reinterpret_cast<gbe_pool *>(new GbePool(romfile, count, threads)); }, nullptr);
+}
+
+void gbe_pool_destroy(gbe_pool *pool) {
+    guarded([&] { delete unwrap(pool); });
+}
+
+unsigned gbe_pool_size(const gbe_pool *pool) {
+    return guarded([&] { return unwrap(pool)->size(); }, 0);
+}
+
+gbe_instance *gbe_pool_get(gbe_pool *pool, unsigned index) {
+    return guarded([&] { return wrap(&(*unwrap(pool))[index]); }, nullptr);
+}
+
+void gbe_pool_watch(gbe_pool *pool, const uint16_t *addresses, unsigned count) {
+    guarded([&] { unwrap(pool)->watch(std::vector<uint16_t>(addresses, addresses + count)); });
+}
+
+size_t gbe_pool_observation_size(const gbe_pool *pool) {
+    return guarded([&] { return unwrap(pool)->observation_size(); }, 0);
+}
+
+void gbe_pool_step(
+    gbe_pool *pool, const uint8_t *actions, unsigned repeat, uint8_t *screens, int32_t *ram, uint8_t *done
+) {
+    guarded([&] { unwrap(pool)->step(actions, screens, ram, done, repeat); });
+}
+
+void gbe_pool_reset(gbe_pool *pool, const uint8_t *mask, uint8_t *screens, int32_t *ram) {
+    guarded([&] { unwrap(pool)->reset(mask, screens, ram); });
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstring>
+
+#include "gbe_pool.h"
+
+using namespace std;
+
+GbePool::GbePool(const string &romfile, unsigned count, unsigned threads)
+    : job(nullptr), generation(0), running(0), next(0), stopping(false) {
+
+    try {
+        for (unsigned i = 0; i < count; ++i)
+            instances.push_back(new gbe(romfile));
+    } catch (...) {
+        // the destructor doesn't run for a constructor that throws
+        for (gbe *instance : instances)
+            delete instance;
+        throw;
+    }
+
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    threads = min(threads, max(count, 1u));
+
+    for (unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(&GbePool::worker_loop, this);
+}
+
+GbePool::~GbePool() {
+    // a pending step_async is cancelled: instances not yet handed out are skipped
+    next = instances.size();
+    finish(generation);
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    for (thread &worker : workers)
+        worker.join();
+
+    for (gbe *instance : instances)
+        delete instance;
+}
+
+void GbePool::watch(const ObservationSchema &schema) {
+    finish(generation);
+    this->schema = schema;
+    this->schema.compile();
+    for (gbe *instance : instances)
+        instance->set_observation_schema(this->schema);
+}
+
+void GbePool::watch(const vector<uint16_t> &addresses) {
+    ObservationSchema bytes;
+    for (uint16_t addr : addresses)
+        bytes.add_u8(addr);
+    watch(bytes);
+}
+
+void GbePool::run_job(const function<void(gbe &, unsigned)> &fn) {
+    for (unsigned i = next++; i < instances.size(); i = next++)
+        fn(*instances[i], i);
+}
+
+unsigned GbePool::start(const function<void(gbe &, unsigned)> &fn) {
+    // generation only changes on the calling thread, no lock needed to read it here
+    finish(generation);
+
+    unique_lock<mutex> guard(lock);
+    job     = &fn;
+    next    = 0;
+    running = workers.size();
+    ++generation;
+    unsigned started = generation;
+    guard.unlock();
+    cond.notify_all();
+
+    return started;
+}
+
+void GbePool::finish(unsigned generation) {
+    unique_lock<mutex> guard(lock);
+    if (job == nullptr || this->generation != generation)
+        return;
+
+    const function<void(gbe &, unsigned)> &fn = *job;
+    guard.unlock();
+    run_job(fn);
+    guard.lock();
+
+    cond.wait(guard, [this] { return running == 0; });
+    job = nullptr;
+}
+
+bool GbePool::finished(unsigned generation) {
+    lock_guard<mutex> guard(lock);
+    return job == nullptr || this->generation != generation || (running == 0 && next >= instances.size());
+}
+
+void GbePool::for_each(const function<void(gbe &, unsigned)> &fn) {
+    finish(start(fn));
+}
+
+void GbePool::worker_loop() {
+    unsigned seen = 0;
+    unique_lock<mutex> guard(lock);
+
+    while (true) {
+        cond.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+
+        const function<void(gbe &, unsigned)> &fn = *job;
+        guard.unlock();
+        run_job(fn);
+        guard.lock();
+
+        if (--running == 0)
+            cond.notify_all();
+    }
+}
+
+void GbePool::observe(gbe &instance, unsigned i, uint8_t *screens, int32_t *ram) {
+    if (screens)
+        instance.write_observation(&screens[i * instance.observation_size()]);
+    if (ram && schema.size() > 0)
+        memcpy(&ram[i * schema.size()], instance.values(), schema.size() * sizeof(int32_t));
+}
+
+void GbePool::step(const uint8_t *actions, uint8_t *screens, int32_t *ram, uint8_t *done, unsigned repeat) {
+    for_each([&](gbe &instance, unsigned i) {
+        const uint8_t *a = &actions[i * POOL_BUTTONS];
+        bool running     = instance.step(gbe::button_mask(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]), repeat);
+
+        observe(instance, i, screens, ram);
+        if (done)
+            done[i] = !running;
+    });
+}
+
+GbePool::Completion GbePool::step_async(
+    const uint8_t *actions, uint8_t *screens, int32_t *ram, uint8_t *done, unsigned repeat
+) {
+    // the previous job may be async_job itself, finish it before replacing the function
+    finish(generation);
+
+    async_job = [this, actions, screens, ram, done, repeat](gbe &instance, unsigned i) {
+        const uint8_t *a = &actions[i * POOL_BUTTONS];
+        bool running     = instance.step(gbe::button_mask(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]), repeat);
+
+        observe(instance, i, screens, ram);
+        if (done)
+            done[i] = !running;
+    };
+    return Completion(this, start(async_job));
+}
+
+void GbePool::configure_step(bool max_pool, double sticky_prob, uint64_t seed) {
+    finish(generation);
+    for (unsigned i = 0; i < instances.size(); ++i)
+        instances[i]->configure_step(max_pool, sticky_prob, seed + i);
+}
+
+void GbePool::configure_observation(const FramePipeline *pipeline) {
+    finish(generation);
+    for (gbe *instance : instances)
+        instance->configure_observation(pipeline);
+}
+
+void GbePool::reset(const uint8_t *mask, uint8_t *screens, int32_t *ram) {
+    for_each([&](gbe &instance, unsigned i) {
+        if (mask && !mask[i])
+            return;
+        instance.reset();
+        observe(instance, i, screens, ram);
+    });
+}
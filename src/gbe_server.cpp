@@ -0,0 +1,234 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <stdexcept>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "env_server.h"
+#include "gbe.h"
+#include "observation.h"
+
+using namespace std;
+
+/*
+ * Hosts emulator instances for clients on the same machine (see ServerChannel).
+ * Instances run in worker processes, so an emulator error that exits takes down
+ * only its worker: the supervisor fails the worker's pending requests with
+ * SERVER_CRASHED and starts a fresh worker for the same environments.
+ */
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop(int) {
+    stopping = 1;
+}
+
+static void observe(gbe &instance, ServerSlot &slot, unsigned value_count) {
+    memcpy(slot.screen, instance.screen(), LCD_W * LCD_H);
+    if (value_count)
+        memcpy(slot.values, instance.values(), value_count * sizeof(int32_t));
+}
+
+static uint32_t serve(gbe &instance, ServerSlot &slot, const ServerHeader &header) {
+    switch (slot.command) {
+        case SERVER_STEP: {
+            bool running = instance.step(slot.buttons, slot.repeat);
+            observe(instance, slot, header.value_count);
+            return running ? SERVER_OK : SERVER_STUCK;
+        }
+        case SERVER_RESET:
+            instance.reset();
+            observe(instance, slot, header.value_count);
+            return SERVER_OK;
+
+        case SERVER_SAVE:
+            instance.save_state(slot.snapshot);
+            return SERVER_OK;
+
+        case SERVER_LOAD: {
+            // snapshots come from the client, load_state rejects one with another cartridge RAM layout
+            try {
+                instance.load_state(slot.snapshot);
+            } catch (const std::invalid_argument &) {
+                return SERVER_FAILED;
+            }
+            observe(instance, slot, header.value_count);
+            return SERVER_OK;
+        }
+        default:
+            return SERVER_FAILED;
+    }
+}
+
+static void worker_loop(ServerChannel &channel, const string &romfile, unsigned worker) {
+    ServerHeader &header = *channel.header;
+
+    ObservationSchema schema;
+    for (unsigned i = 0; i < header.value_count; ++i)
+        schema.add_u8(header.watch[i]);
+
+    vector<unsigned> envs;
+    vector<gbe *> instances;
+    for (unsigned env = worker; env < header.env_count; env += header.worker_count) {
+        envs.push_back(env);
+        instances.push_back(new gbe(romfile));
+        instances.back()->set_observation_schema(schema);
+    }
+
+    while (!header.shutdown.load(memory_order_acquire)) {
+        uint32_t submitted = header.submitted[worker].load(memory_order_acquire);
+        bool busy          = false;
+
+        for (size_t k = 0; k < envs.size(); ++k) {
+            ServerSlot &slot = channel.slot(envs[k]);
+            if (slot.request.load(memory_order_acquire) == slot.done.load(memory_order_relaxed))
+                continue;
+
+            busy            = true;
+            uint32_t status = serve(*instances[k], slot, header);
+            if (slot.lost) {
+                slot.lost = 0;
+                status    = SERVER_CRASHED;
+            }
+            channel.complete(envs[k], status);
+        }
+
+        if (!busy)
+            ServerChannel::wait(header.submitted[worker], submitted);
+    }
+
+    for (gbe *instance : instances)
+        delete instance;
+}
+
+static pid_t start_worker(ServerChannel &channel, const string &romfile, unsigned worker) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN); // the supervisor stops workers through the shutdown flag
+        signal(SIGTERM, SIG_DFL);
+        worker_loop(channel, romfile, worker);
+        _exit(0); // leave the shared memory to the supervisor
+    }
+    if (pid < 0)
+        printf("[server] could not start worker %u\n", worker);
+    return pid;
+}
+
+// fail the requests the dead worker left pending, and flag its idle environments as reset
+static void recover(ServerChannel &channel, unsigned worker) {
+    for (unsigned env = worker; env < channel.size(); env += channel.header->worker_count) {
+        ServerSlot &slot = channel.slot(env);
+        if (slot.request.load(memory_order_acquire) != slot.done.load(memory_order_relaxed))
+            channel.complete(env, SERVER_CRASHED);
+        else
+            slot.lost = 1;
+    }
+}
+
+static void usage() {
+    printf("usage: gbe_server --rom FILE [--envs N] [--workers N] [--name /SHM_NAME] [--watch ADDR,ADDR,...]\n");
+}
+
+int main(int argc, char **argv) {
+    string romfile, name = "/gbe_server";
+    unsigned envs = 1, workers = 0;
+    vector<uint16_t> watch;
+
+    while (true) {
+        static struct option long_options[] = {
+            {"rom", required_argument, nullptr, 'R'},     {"envs", required_argument, nullptr, 'n'},
+            {"workers", required_argument, nullptr, 'w'}, {"name", required_argument, nullptr, 'N'},
+            {"watch", required_argument, nullptr, 'W'},   {nullptr, 0, nullptr, 0}
+        };
+
+        int c = getopt_long(argc, argv, "R:n:w:N:W:", long_options, nullptr);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'R':
+                romfile = optarg;
+                break;
+            case 'n':
+                envs = stoul(optarg, 0, 0);
+                break;
+            case 'w':
+                workers = stoul(optarg, 0, 0);
+                break;
+            case 'N':
+                name = optarg;
+                break;
+            case 'W':
+                for (char *addr = strtok(optarg, ","); addr != nullptr; addr = strtok(nullptr, ","))
+                    watch.push_back(stoul(addr, 0, 0));
+                break;
+            default:
+                usage();
+                exit(1);
+        }
+    }
+
+    if (romfile.empty() || envs == 0) {
+        usage();
+        exit(1);
+    }
+    if (workers == 0)
+        workers = max(1u, min(envs, unsigned(sysconf(_SC_NPROCESSORS_ONLN))));
+    workers = min(workers, envs);
+
+    size_t state_size;
+    try {
+        state_size = gbe(romfile).state_size();
+    } catch (const std::runtime_error &e) {
+        printf("[server] %s\n", e.what());
+        exit(1);
+    }
+
+    ServerChannel *channel = ServerChannel::create(name, envs, workers, state_size, watch.data(), watch.size());
+    if (channel == nullptr)
+        exit(1);
+
+    struct sigaction action = {};
+    action.sa_handler       = handle_stop;
+    sigaction(SIGINT, &action, nullptr); // no SA_RESTART, so waitpid returns on a signal
+    sigaction(SIGTERM, &action, nullptr);
+
+    vector<pid_t> pids(workers);
+    for (unsigned w = 0; w < workers; ++w)
+        pids[w] = start_worker(*channel, romfile, w);
+
+    printf("[server] %u environments in %u workers at %s\n", envs, workers, name.c_str());
+
+    while (!stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid <= 0)
+            continue;
+
+        for (unsigned w = 0; w < workers; ++w) {
+            if (pids[w] != pid)
+                continue;
+            printf("[server] worker %u exited (status %d), restarting\n", w, status);
+            recover(*channel, w);
+            pids[w] = start_worker(*channel, romfile, w);
+        }
+    }
+
+    channel->header->shutdown.store(1, memory_order_release);
+    for (unsigned w = 0; w < workers; ++w) {
+        channel->header->submitted[w].fetch_add(1);
+        ServerChannel::wake(channel->header->submitted[w]);
+    }
+    for (pid_t pid : pids)
+        if (pid > 0)
+            waitpid(pid, nullptr, 0);
+
+    delete channel;
+    return 0;
+}
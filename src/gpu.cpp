@@ -8,7 +8,8 @@ using namespace std;
 using namespace std::chrono;
 
 void Gpu::render_tileset() {
-    uint8_t *SET = MEM.TILESET1;
+    uint8_t *SET = MEM.TILESET1();
+    tileset_buffer.resize(TILESET_WINDOW_H * TILESET_WINDOW_W * 3);
 
     uint16_t tile_id = 0;
     for (uint8_t yoff = 0; yoff < 24; ++yoff) {
@@ -43,10 +44,21 @@ inline void Gpu::draw_pixel(uint8_t *addr, uint8_t color_id) {
     }
 }
 
+uint8_t *Gpu::lcd_rgb() {
+    rgb_buffer.resize(LCD_H * LCD_W * 3);
+
+    const uint8_t *shades = lcd_shades();
+    for (unsigned y = 0; y < LCD_H; ++y)
+        for (unsigned x = 0; x < LCD_W; ++x)
+            draw_pixel(&rgb_buffer[rgb_buffer_index(x, y, LCD_W, LCD_H)], shades[y * LCD_W + x]);
+
+    return rgb_buffer.data();
+}
+
 inline uint8_t *Gpu::get_tile(const uint8_t tile_id, const bool tileset1) {
     uint8_t *tile;
     if (tileset1) {
-        tile = &MEM.TILESET1[tile_id * 16];
+        tile = &MEM.TILESET1()[tile_id * 16];
     } else {
         tile = MEM.getReadPtr(0x9000 + (int16_t)((int8_t)tile_id) * 16);
     }
@@ -61,7 +73,7 @@ void Gpu::render_buffer_line() {
     uint8_t lcd_y = *MEM.SCAN_LN;
     assert(lcd_y < LCD_H);
 
-    uint8_t *BG_MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP1 : MEM.TILEMAP0;
+    uint8_t *BG_MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP1() : MEM.TILEMAP0();
 
     uint8_t scrl_x = *MEM.SCRL_X;
     uint8_t scrl_y = *MEM.SCRL_Y;
@@ -70,7 +82,7 @@ void Gpu::render_buffer_line() {
     uint8_t bg_map_tile_y  = bg_map_pixel_y / TILE_H;
     uint8_t bg_tile_y      = bg_map_pixel_y % TILE_H;
 
-    uint8_t *WIN_MAP = (*MEM.LCD_CTRL & FLAG_GPU_WIN_TM) ? MEM.TILEMAP1 : MEM.TILEMAP0;
+    uint8_t *WIN_MAP = (*MEM.LCD_CTRL & FLAG_GPU_WIN_TM) ? MEM.TILEMAP1() : MEM.TILEMAP0();
 
     int window_x = *MEM.WIN_X - 7;
     int window_y = *MEM.WIN_Y;
@@ -180,8 +192,7 @@ void Gpu::render_buffer_line() {
             }
         }
 
-        unsigned i = rgb_buffer_index(lcd_x, lcd_y, LCD_W, LCD_H);
-        draw_pixel(&write_buffer[i], color);
+        shade_buffers[front_buffer ^ 1][lcd_y * LCD_W + lcd_x] = color;
     }
 }
 
@@ -232,7 +243,8 @@ void Gpu::render_tile(
 }
 
 void Gpu::render_tilemap() {
-    uint8_t *MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP1 : MEM.TILEMAP0;
+    uint8_t *MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP1() : MEM.TILEMAP0();
+    tilemap_buffer.resize(TILEMAP_WINDOW_H * 2 * TILEMAP_WINDOW_W * 3);
 
     for (uint8_t xoff = 0; xoff < TILEMAP_W; ++xoff) {
         for (uint8_t yoff = 0; yoff < TILEMAP_H; ++yoff) {
@@ -246,7 +258,7 @@ void Gpu::render_tilemap() {
         }
     }
 
-    MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP0 : MEM.TILEMAP1;
+    MAP = (*MEM.LCD_CTRL & FLAG_GPU_BG_TM) ? MEM.TILEMAP0() : MEM.TILEMAP1();
 
     for (uint8_t xoff = 0; xoff < TILEMAP_W; ++xoff) {
         for (uint8_t yoff = 0; yoff < TILEMAP_H; ++yoff) {
@@ -334,7 +346,7 @@ void Gpu::update(unsigned tclock) {
                     if (*MEM.SCAN_LN == LCD_H) {
                         *MEM.IF |= FLAG_IF_VBLANK;
                         set_status(MODE_VBLANK);
-                        lcd_buffer.swap(write_buffer);
+                        front_buffer ^= 1;
                     } else {
                         set_status(MODE_OAM);
                     }
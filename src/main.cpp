@@ -3,8 +3,10 @@
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
+#include "battery.h"
 #include "buttons.h"
 #include "cart.h"
 #include "cpu.h"
@@ -13,8 +15,11 @@
 #include "mem.h"
 #include "openal_output.h"
 #include "reg.h"
+#include "rewind.h"
+#include "savestate.h"
 #include "serial.h"
 #include "sound.h"
+#include "state.h"
 #include "sync.h"
 #include "timer.h"
 
@@ -67,15 +72,19 @@ int main(int argc, char **argv) {
 
     int log_register_bytes = false, log_register_words = false, log_flags = false, log_gpu = false,
         log_instructions = false, breakpoint = false, mem_breakpoint = false, stepping = false, load_bios = false,
-        load_rom = false, unlocked_frame_rate = false, log_serial = false, headless = false;
+        load_rom = false, unlocked_frame_rate = false, log_serial = false, headless = false, record_stems = false,
+        turbo = false, no_battery = false;
 
-    string romfile, biosfile;
+    string romfile, biosfile, audio_file;
 
     uint16_t breakpoint_addr     = 0;
     uint16_t mem_breakpoint_addr = 0;
 
     unsigned long long instruction_limit = 0;
 
+    unsigned turbo_skip = TURBO_FRAME_SKIP;
+    unsigned rewind_mb  = REWIND_BUDGET_MB;
+
     int c;
 
     while (true) {
@@ -87,7 +96,10 @@ int main(int argc, char **argv) {
                 {"unlockfps", no_argument, nullptr, 'u'}, {"console", no_argument, nullptr, 'c'},
                 {"bios", required_argument, nullptr, 'B'}, {"rom", required_argument, nullptr, 'R'},
                 {"breakpoint", required_argument, nullptr, 'b'}, {"step", required_argument, nullptr, 's'},
-                {"memory-breakpoint", required_argument, nullptr, 'M'}, {
+                {"memory-breakpoint", required_argument, nullptr, 'M'},
+                {"record-audio", required_argument, nullptr, 'A'}, {"record-stems", no_argument, &record_stems, 1},
+                {"turbo", optional_argument, nullptr, 'T'}, {"rewind-mb", required_argument, nullptr, 'W'},
+                {"no-battery", no_argument, &no_battery, 1}, {
                 nullptr, 0, nullptr, 0
             }
         };
@@ -156,6 +168,20 @@ int main(int argc, char **argv) {
                 headless = true;
                 break;
 
+            case 'A':
+                audio_file = string(optarg);
+                break;
+
+            case 'T':
+                turbo = true;
+                if (optarg)
+                    turbo_skip = stoul(optarg, 0, 0);
+                break;
+
+            case 'W':
+                rewind_mb = stoul(optarg, 0, 0);
+                break;
+
             case '?':
                 // getopt_long already printed an error message.
                 break;
@@ -177,28 +203,50 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
-    Buttons BTN;
-    Sound SND;
-    OpenAL_Output SND_OUT(SND);
-    Cart CART(romfile, true);
-    Memory MEM(CART, BTN, SND);
+    std::shared_ptr<const RomImage> rom;
+    try {
+        rom = RomStore::load(romfile);
+        Cart::check_header(*rom);
+    } catch (const std::runtime_error &e) {
+        printf("%s\n", e.what());
+        exit(1);
+    }
+
+    // battery-backed cartridge RAM is mapped from a save file next to the ROM
+    unsigned cart_ram_size = Cart::state_size_of(rom->data);
+    BatterySave *BATTERY   = nullptr;
+    MachineState *STATE    = nullptr;
+    if (!no_battery && cart_ram_size && Cart::has_battery(rom->data)) {
+        BATTERY = new BatterySave(BatterySave::filename_for(romfile), cart_ram_size);
+        STATE   = BATTERY->state;
+    }
+    if (STATE == nullptr)
+        STATE = MachineState::create(cart_ram_size);
+
+    Buttons BTN(STATE->buttons);
+    Sound SND(STATE->sound);
+    // no audio device needed when running headless
+    OpenAL_Output *SND_OUT = headless ? nullptr : new OpenAL_Output(SND);
+    Cart CART(rom, STATE->cart, STATE->cart_ram(), true);
+    Memory MEM(CART, BTN, SND, *STATE);
 
-    Registers REG;
+    Registers &REG = STATE->REG;
 
-    Gpu GPU(MEM);
+    Gpu GPU(MEM, STATE->gpu);
 
     UI *interface = headless ? static_cast<UI *>(new Headless())
-                             : static_cast<UI *>(new Window(MEM, BTN, SND, GPU, unlocked_frame_rate));
+                             : static_cast<UI *>(new Window(MEM, BTN, SND, GPU, unlocked_frame_rate, turbo_skip));
+    interface->turbo = turbo;
 
-    Timer TIMER(MEM);
+    Timer TIMER(MEM, STATE->timer);
 
-    Cpu CPU(MEM, REG);
+    Cpu CPU(MEM, REG, STATE->cpu);
 
     std::function<void(uint8_t)> serial_callback = [](uint8_t) {};
     if (log_serial) {
         serial_callback = [](uint8_t b) { printf("[serial] %d\n", b); };
     }
-    SerialPortInterface SERIAL(MEM, serial_callback);
+    SerialPortInterface SERIAL(MEM, STATE->serial, serial_callback);
 
     if (load_bios) {
         readBIOSFile(MEM, biosfile);
@@ -223,6 +271,22 @@ int main(int argc, char **argv) {
     // enable LCD
     *MEM.LCD_CTRL |= 0x80;
 
+    if (!audio_file.empty()) {
+        try {
+            SND.startCapture(audio_file, record_stems);
+        } catch (const std::runtime_error &e) {
+            printf("%s\n", e.what());
+            exit(1);
+        }
+    }
+
+    SaveStateWriter STATE_WRITER;
+
+    // one snapshot per frame, rewound while the rewind key is held
+    Rewind *REWIND                = (headless || !rewind_mb) ? nullptr : new Rewind(STATE->size(), rewind_mb);
+    unsigned long long rewind_clk = 0;
+    unsigned ui_clk               = 0; // cycles not yet passed to the interface
+
     // start audio/video sync timer
     SyncTimer::get().start();
 
@@ -234,27 +298,13 @@ int main(int argc, char **argv) {
                              interface->breakpoint;
 
         if (interface->save_state) {
-            ofstream file("gbe.state", ifstream::binary);
-            file << REG;
-            file << MEM;
-            file << SND_OUT;
-            file << GPU;
-            file << CART;
-            file << *interface;
-            file << SyncTimer::get();
-            file.close();
+            STATE_WRITER.save(SaveState::slot_filename(interface->state_slot), *STATE, CART.ROM);
         }
 
         if (interface->load_state) {
-            ifstream file("gbe.state", ifstream::binary);
-            file >> REG;
-            file >> MEM;
-            file >> SND_OUT;
-            file >> GPU;
-            file >> CART;
-            file >> *interface;
-            file >> SyncTimer::get();
-            file.close();
+            // a save to the same slot may still be in flight
+            STATE_WRITER.flush();
+            SaveState::load(SaveState::slot_filename(interface->state_slot), *STATE, CART.ROM);
         }
 
         interface->load_state = false;
@@ -383,8 +433,7 @@ int main(int argc, char **argv) {
         SERIAL.update(REG.TCLK);
         SND.update(REG.TCLK);
 
-        interface->update(REG.TCLK);
-
+        ui_clk += REG.TCLK;
         clk += REG.TCLK;
 
         REG.TCLK = 0;
@@ -397,11 +446,30 @@ int main(int argc, char **argv) {
             SND.update(REG.TCLK);
         }
 
-        interface->update(REG.TCLK);
+        ui_clk += REG.TCLK;
+
+        // in turbo the window and audio output only see every scanline: input and frame skipping don't need
+        // more, and the audio is decimated anyway
+        if (!interface->turbo || ui_clk >= TURBO_UPDATE_CLK) {
+            interface->update(ui_clk);
+            ui_clk = 0;
 
-        SND_OUT.update_buffer();
+            if (SND_OUT) {
+                SND_OUT->drop_excess = interface->turbo;
+                SND_OUT->update_buffer();
+            }
+        }
 
         clk += REG.TCLK;
+
+        if (REWIND && clk - rewind_clk >= 70224) {
+            rewind_clk = clk;
+            if (interface->rewind)
+                REWIND->pop(reinterpret_cast<uint8_t *>(STATE));
+            else
+                REWIND->push(reinterpret_cast<uint8_t *>(STATE));
+        }
+
         if (instruction_limit && clk > instruction_limit)
             break;
         if (CPU.is_stuck()) {
@@ -413,5 +481,11 @@ int main(int argc, char **argv) {
     printf("Time: %lld ms\n", SyncTimer::get().elapsed_ms());
     printf("Clk: %lld\n", clk);
     printf("Samples generated: %lu\n", SND.samples);
-    printf("Samples played: %lu\n", SND_OUT.samples);
+    if (SND_OUT) {
+        printf("Samples played: %lu\n", SND_OUT->samples);
+        printf("Audio underruns: %lu (latency target %u ms)\n", SND_OUT->underruns, SND_OUT->target_latency_ms);
+        delete SND_OUT;
+    }
+    delete REWIND;
+    delete BATTERY;
 }
\ No newline at end of file
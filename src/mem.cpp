@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -29,29 +30,29 @@ uint8_t *Memory::getReadPtr(uint16_t addr) {
             return CART.rom1Ptr(addr - 0x4000);
         case 0x8:
         case 0x9:
-            return &RAW[addr]; // grRAM
+            return &VRAM.data[addr - 0x8000]; // grRAM
         case 0xA:
         case 0xB:
             // extRAM or RTC
             return CART.ramPtr(addr - 0xA000);
         case 0xC:
         case 0xD:
-            return &RAW[addr];   // RAM
-        default:                 // E, F
-            if (addr < 0xFE00) { // shadow RAM
-                return &RAW[addr & 0xDFFF];
+            return &WRAM.data[addr - 0xC000]; // RAM
+        default:                              // E, F
+            if (addr < 0xFE00) {              // shadow RAM
+                return &WRAM.data[addr - 0xE000];
             } else {
                 switch (addr & 0xFF80) {
                     case 0xFE00: // SPR
                     case 0xFE80:
                         if (addr < 0xFEA0)
-                            return &RAW[addr];
+                            return &HIGH[addr - 0xFE00];
                         else
                             return nullptr;
                     case 0xFF00: // IO
-                        return &RAW[addr];
+                        return &HIGH[addr - 0xFE00];
                     case 0xFF80: // ZERO
-                        return &RAW[addr];
+                        return &HIGH[addr - 0xFE00];
                     default:
                         printf("[mem] read from bad address 0x%04X\n", addr);
                         exit(1);
@@ -76,24 +77,27 @@ uint8_t *Memory::getWritePtr(uint16_t addr) {
         case 0x8:
         case 0x9:
             // grRAM
-            return &RAW[addr];
+            mark_dirty((addr - 0x8000) >> 8);
+            return &VRAM.writable()[addr - 0x8000];
         case 0xA:
         case 0xB:
             // extRAM or RTC
-            return CART.ramPtr(addr - 0xA000);
+            return CART.ramWritePtr(addr - 0xA000);
         case 0xC:
         case 0xD:
             // RAM
-            return &RAW[addr];
+            mark_dirty(0x20 + ((addr - 0xC000) >> 8));
+            return &WRAM.writable()[addr - 0xC000];
         default:                 // E, F
             if (addr < 0xFE00) { // shadow RAM
-                return &RAW[addr & 0xDFFF];
+                mark_dirty(0x20 + ((addr - 0xE000) >> 8));
+                return &WRAM.writable()[addr - 0xE000];
             } else {
                 switch (addr & 0xFF80) {
                     case 0xFE00: // SPR
                     case 0xFE80:
                         if (addr < 0xFEA0)
-                            return &RAW[addr];
+                            return &HIGH[addr - 0xFE00];
                         else
                             return nullptr;
                     case 0xFF00: // IO
@@ -103,9 +107,9 @@ uint8_t *Memory::getWritePtr(uint16_t addr) {
                         if (addr == 0xFF44) {
                             return nullptr;
                         }
-                        return &RAW[addr];
+                        return &HIGH[addr - 0xFE00];
                     case 0xFF80: // ZERO
-                        return &RAW[addr];
+                        return &HIGH[addr - 0xFE00];
                     default:
                         printf("[mem] write to bad address 0x%04X\n", addr);
                         exit(1);
@@ -136,6 +140,42 @@ uint8_t Memory::readByte(uint16_t addr) {
     }
 }
 
+uint8_t Memory::peek(uint16_t addr) {
+    if (addr >= 0xFF10 && addr <= 0xFF3F)
+        return SND.readByte(addr);
+
+    uint8_t *ptr = getReadPtr(addr);
+    if (ptr == nullptr)
+        return 0;
+    return addr == 0xFF00 ? ~*ptr : *ptr; // JOYPAD
+}
+
+void Memory::read_range(uint16_t addr, uint8_t *out, size_t count) {
+    while (count > 0) {
+        // below 0xFE00 each 4K block maps to one contiguous area, apart from the BIOS overlay and RTC registers
+        bool bios = addr < 0x0100 && !*BIOS_OFF;
+        bool rtc  = addr >= 0xA000 && addr < 0xC000 && CART.RTC_access;
+        if (addr >= 0xFE00 || bios || rtc) {
+            *out++ = peek(addr++);
+            --count;
+            continue;
+        }
+
+        size_t end  = std::min(unsigned(addr | 0x0FFF) + 1, 0xFE00u);
+        size_t span = std::min(count, end - addr);
+
+        uint8_t *ptr = getReadPtr(addr);
+        if (ptr != nullptr)
+            memcpy(out, ptr, span);
+        else
+            memset(out, 0, span);
+
+        out += span;
+        addr += span;
+        count -= span;
+    }
+}
+
 uint16_t Memory::readWord(uint16_t addr) {
     assert(!(addr >= 0xFF10 && addr <= 0xFF26)); // not a sound register
     if (break_addr == addr)
@@ -195,7 +235,7 @@ void Memory::writeByte(uint16_t addr, uint8_t val) {
         // printf("OAM DMA\n");
         // assert(val <= 0xF1);
         for (uint8_t low = 0x00; low <= 0xF9; ++low) {
-            RAW[0xFE00 + low] = readByte((((uint16_t)val) << 8) + low);
+            HIGH[low] = readByte((((uint16_t)val) << 8) + low);
         }
     } else if (addr == 0xFF04) {
         // divider register reset on write
@@ -285,7 +325,7 @@ void Memory::writeByte(uint16_t addr, uint8_t val) {
         fprintf(stdout, "[Warning] Attempting write to address 0x%04X\n", addr);
         return;
     }
-    *ptr = val;
+    store(ptr, val);
 }
 
 void Memory::writeWord(uint16_t addr, uint16_t val) {
@@ -298,28 +338,57 @@ void Memory::writeWord(uint16_t addr, uint16_t val) {
         fprintf(stdout, "[Warning] Attempting write to address 0x%04X\n", addr);
         return;
     }
-    uint16_t *wptr = reinterpret_cast<uint16_t *>(ptr);
-    *wptr          = val;
+    store(ptr, val & 0xFF);
+
+    // the high byte may be in the next region, or in a copy-on-write region not yet unshared
+    uint8_t *high = getWritePtr(addr + 1);
+
+    if (high == nullptr) {
+        fprintf(stdout, "[Warning] Attempting write to address 0x%04X\n", uint16_t(addr + 1));
+        return;
+    }
+    store(high, val >> 8);
 }
 
 uint64_t Memory::checksum() const {
     uint64_t sum = 0;
 
-    for (uint8_t ch : RAW)
-        sum += ch;
+    for (unsigned i = 0; i < VRAM.size; ++i)
+        sum += VRAM.data[i];
+    for (unsigned i = 0; i < WRAM.size; ++i)
+        sum += WRAM.data[i];
+    for (unsigned i = 0; i < sizeof(HIGH); ++i)
+        sum += HIGH[i];
 
     return sum;
 }
 
+void Memory::share_with(Memory &child) {
+    VRAM.share_with(child.VRAM);
+    WRAM.share_with(child.WRAM);
+    CART.share_with(child.CART);
+}
+
+void Memory::release_shared() {
+    VRAM.release();
+    WRAM.release();
+    CART.release_shared();
+}
+
 ostream &operator<<(ostream &out, const Memory &mem) {
     cout << "Write " << mem.checksum() << endl;
-    out.write(reinterpret_cast<const char *>(mem.RAW), sizeof(mem.RAW));
+    out.write(reinterpret_cast<const char *>(mem.VRAM.data), mem.VRAM.size);
+    out.write(reinterpret_cast<const char *>(mem.WRAM.data), mem.WRAM.size);
+    out.write(reinterpret_cast<const char *>(mem.HIGH), sizeof(mem.HIGH));
     return out;
 }
 
 istream &operator>>(istream &in, Memory &mem) {
     cout << "State " << mem.checksum() << endl;
-    in.read(reinterpret_cast<char *>(mem.RAW), sizeof(mem.RAW));
+    in.read(reinterpret_cast<char *>(mem.VRAM.writable()), mem.VRAM.size);
+    in.read(reinterpret_cast<char *>(mem.WRAM.writable()), mem.WRAM.size);
+    in.read(reinterpret_cast<char *>(mem.HIGH), sizeof(mem.HIGH));
+    mem.STATE.rehash();
     cout << "Read " << mem.checksum() << endl;
     return in;
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cassert>
+
+#include "mem.h"
+#include "observation.h"
+
+using namespace std;
+
+// fields closer than this are read as one range, skipping a few bytes is cheaper than another block copy
+#define MERGE_GAP 16u
+
+void ObservationSchema::add(uint16_t addr, field_type type, unsigned length, unsigned shift, unsigned width) {
+    fields.push_back(Field{addr, type, uint8_t(length), uint8_t(shift), uint8_t(width), 0});
+    compiled = false;
+}
+
+void ObservationSchema::add_u8(uint16_t addr) {
+    add(addr, U8, 1);
+}
+
+void ObservationSchema::add_u16le(uint16_t addr) {
+    add(addr, U16LE, 2);
+}
+
+void ObservationSchema::add_bcd(uint16_t addr, unsigned bytes, bool little_endian) {
+    assert(bytes >= 1 && bytes <= 4);
+    add(addr, little_endian ? BCD_LE : BCD, bytes);
+}
+
+void ObservationSchema::add_bits(uint16_t addr, unsigned shift, unsigned width) {
+    assert(width >= 1 && shift + width <= 8);
+    add(addr, BITS, 1, shift, width);
+}
+
+void ObservationSchema::compile() {
+    vector<unsigned> order(fields.size());
+    for (unsigned i = 0; i < order.size(); ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return fields[a].addr < fields[b].addr; });
+
+    ranges.clear();
+    unsigned end = 0; // one past the last address of the current range, may be past 0xFFFF
+
+    for (unsigned i : order) {
+        Field &field = fields[i];
+
+        if (ranges.empty() || field.addr > end + MERGE_GAP) {
+            unsigned offset = ranges.empty() ? 0 : ranges.back().offset + ranges.back().length;
+            ranges.push_back(Range{field.addr, 0, offset});
+            end = field.addr;
+        }
+
+        Range &range = ranges.back();
+        end          = max(end, unsigned(field.addr) + field.length);
+        range.length = end - range.addr;
+        field.offset = range.offset + (field.addr - range.addr);
+    }
+
+    buffer.resize(ranges.empty() ? 0 : ranges.back().offset + ranges.back().length);
+    compiled = true;
+}
+
+static int32_t decode_bcd(const uint8_t *bytes, unsigned length, bool little_endian) {
+    int32_t value = 0;
+    for (unsigned k = 0; k < length; ++k) {
+        uint8_t b = bytes[little_endian ? length - 1 - k : k];
+        value     = value * 100 + (b >> 4) * 10 + (b & 0x0F);
+    }
+    return value;
+}
+
+void ObservationSchema::gather(Memory &mem, int32_t *out) {
+    if (!compiled)
+        compile();
+
+    for (const Range &range : ranges)
+        mem.read_range(range.addr, &buffer[range.offset], range.length);
+
+    for (const Field &field : fields) {
+        const uint8_t *bytes = &buffer[field.offset];
+
+        switch (field.type) {
+            case U8:
+                *out++ = bytes[0];
+                break;
+            case U16LE:
+                *out++ = bytes[0] | (bytes[1] << 8);
+                break;
+            case BCD:
+            case BCD_LE:
+                *out++ = decode_bcd(bytes, field.length, field.type == BCD_LE);
+                break;
+            case BITS:
+                *out++ = (bytes[0] >> field.shift) & ((1u << field.width) - 1);
+                break;
+        }
+    }
+}
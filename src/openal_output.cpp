@@ -3,11 +3,13 @@
 
 #include <AL/alc.h>
 #include <AL/alut.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
 
 using namespace std;
 using namespace std::literals;
@@ -61,9 +63,15 @@ void exit_al() {
     alcCloseDevice(dev);
 }
 
-OpenAL_Output::OpenAL_Output(Sound &SndRef) : SND(SndRef), queue_head(0), queue_tail(0), samples(0), queued_buffers(0) {
+OpenAL_Output::OpenAL_Output(Sound &SndRef)
+    : SND(SndRef), queue_head(0), queue_tail(0), samples(0), queued_buffers(0), rate_ratio(1.0), drop_excess(false),
+      resample_pos(0), resample_restart(true), underruns(0), refilling(false),
+      target_latency_ms(TARGET_LATENCY_MS) {
     init_al();
 
+    std::fill(hist_l, hist_l + 4, 0.0f);
+    std::fill(hist_r, hist_r + 4, 0.0f);
+
     buffer_size = 2 * SAMPLE_RATE * AL_BUFFER_LEN_MS / 1000;
 
     /* Set-up sound source and play buffer */
@@ -85,6 +93,92 @@ unsigned OpenAL_Output::queueSize() {
     return (queue_capacity + queue_tail - queue_head) % queue_capacity;
 }
 
+// Catmull-Rom interpolation between p[1] and p[2]
+static inline float cubic(const float *p, float t) {
+    return p[1] + 0.5f * t *
+                      (p[2] - p[0] +
+                       t * (2.0f * p[0] - 5.0f * p[1] + 4.0f * p[2] - p[3] + t * (3.0f * (p[1] - p[2]) + p[3] - p[0])));
+}
+
+static inline sample_t clamp_sample(float v) {
+    return sample_t(std::clamp(v, float(numeric_limits<sample_t>::min()), float(numeric_limits<sample_t>::max())));
+}
+
+void OpenAL_Output::push_sample(sample_t left, sample_t right) {
+
+    assert((queue_tail + 2) % queue_capacity != queue_head);
+
+    sample_queue[queue_tail]     = left;
+    sample_queue[queue_tail + 1] = right;
+    if (queue_tail < buffer_size) {
+        sample_queue[buffer_size + queue_tail]     = left;
+        sample_queue[buffer_size + queue_tail + 1] = right;
+    } else {
+        // printf("[snd] queue full\n");
+    }
+    queue_tail = (queue_tail + 2) % queue_capacity;
+}
+
+void OpenAL_Output::resample(sample_t left, sample_t right) {
+
+    if (resample_restart) {
+        // after a gap, hold the first new frame instead of interpolating from audio that was dropped
+        std::fill(hist_l, hist_l + 4, float(left));
+        std::fill(hist_r, hist_r + 4, float(right));
+        resample_pos     = 0;
+        resample_restart = false;
+    }
+
+    for (unsigned i = 0; i < 3; ++i) {
+        hist_l[i] = hist_l[i + 1];
+        hist_r[i] = hist_r[i + 1];
+    }
+    hist_l[3] = left;
+    hist_r[3] = right;
+
+    // emit output frames until read position passes the newest complete interval
+    const double step = 1.0 / rate_ratio;
+    while (resample_pos < 1.0) {
+        float t = float(resample_pos);
+        push_sample(clamp_sample(cubic(hist_l, t)), clamp_sample(cubic(hist_r, t)));
+        resample_pos += step;
+    }
+    resample_pos -= 1.0;
+}
+
+double OpenAL_Output::queued_samples() {
+    // audio not yet played, in stereo samples
+    return double(queued_buffers) * buffer_size + queueSize();
+}
+
+void OpenAL_Output::reclaim_buffers() {
+    ALint Processed;
+    alGetSourcei(src, AL_BUFFERS_PROCESSED, &Processed);
+
+    while (Processed--) {
+        ALuint BufID;
+        --queued_buffers;
+        alSourceUnqueueBuffers(src, 1, &BufID);
+        alDeleteBuffers(1, &BufID);
+        al_check_error();
+    }
+}
+
+double OpenAL_Output::target_samples() {
+    return 2.0 * SAMPLE_RATE * target_latency_ms / 1000;
+}
+
+void OpenAL_Output::update_rate() {
+    const double fill   = queued_samples();
+    const double target = target_samples();
+
+    // stretch audio when the queue runs low, compress when it grows
+    double error   = std::clamp((target - fill) / target, -1.0, 1.0);
+    double desired = 1.0 + MAX_RATE_DELTA * error;
+
+    rate_ratio += RATE_SMOOTHING * (desired - rate_ratio);
+}
+
 void OpenAL_Output::update_buffer() {
 
     if (SND.hasNewSample()) {
@@ -94,23 +188,36 @@ void OpenAL_Output::update_buffer() {
         sample_t left, right;
         SND.getSamples(&left, &right);
 
-        assert((queue_tail + 2) % queue_capacity != queue_head);
-
-        sample_queue[queue_tail]     = left;
-        sample_queue[queue_tail + 1] = right;
-        if (queue_tail < buffer_size) {
-            sample_queue[buffer_size + queue_tail]     = left;
-            sample_queue[buffer_size + queue_tail + 1] = right;
-        } else {
-            // printf("[snd] queue full\n");
+        // when fast-forwarding, samples arrive faster than they play:
+        // drop them while enough audio is queued, which decimates the output
+        if (drop_excess && queued_samples() >= 2 * target_samples()) {
+            if (samples % RECLAIM_INTERVAL == 0)
+                reclaim_buffers();
+            resample_restart = true;
+            return;
         }
-        queue_tail = (queue_tail + 2) % queue_capacity;
+
+        resample(left, right);
 
         if (queueSize() >= buffer_size) {
 
             sample_t *buffer = &sample_queue[queue_head];
             queue_head       = (queue_head + buffer_size) % queue_capacity;
 
+            ALint val;
+            alGetSourcei(src, AL_SOURCE_STATE, &val);
+
+            // a source that ran dry counts all its buffers as processed: unqueue the played ones once, then leave
+            // the queue alone until it is restarted
+            if (val == AL_STOPPED && !refilling) {
+                ++underruns;
+                refilling         = true;
+                target_latency_ms = std::min(target_latency_ms + AL_BUFFER_LEN_MS, unsigned(MAX_LATENCY_MS));
+                reclaim_buffers();
+            } else if (!refilling) {
+                reclaim_buffers();
+            }
+
             ALuint new_buffer;
             alGenBuffers(1, &new_buffer);
             al_check_error();
@@ -120,22 +227,15 @@ void OpenAL_Output::update_buffer() {
             ++queued_buffers;
             alSourceQueueBuffers(src, 1, &new_buffer);
 
-            ALint val;
-            alGetSourcei(src, AL_SOURCE_STATE, &val);
-            if (val != AL_PLAYING)
+            // (re)start only once the target latency is queued, a shorter queue would run dry again at once
+            if (val != AL_PLAYING && queued_samples() >= target_samples()) {
+                refilling        = false;
+                resample_restart = true;
                 alSourcePlay(src);
-
-            ALint Processed;
-            alGetSourcei(src, AL_BUFFERS_PROCESSED, &Processed);
-
-            while (Processed--) {
-                ALuint BufID;
-                --queued_buffers;
-                alSourceUnqueueBuffers(src, 1, &BufID);
-                alDeleteBuffers(src, &BufID);
-                al_check_error();
             }
 
+            update_rate();
+
             // if (queued_buffers% 10 == 0)
             //   printf("%ld\n", queued_buffers);
         }
@@ -0,0 +1,135 @@
+#include <cstring>
+
+#include "rewind.h"
+
+using namespace std;
+
+// run header in the encoded stream, followed by len XOR words
+struct Run {
+    uint32_t skip;
+    uint32_t len;
+};
+
+Rewind::Rewind(size_t state_size, unsigned budget_mb, unsigned keyframe_interval)
+    : state_size(state_size), words((state_size + 7) / 8), budget(size_t(budget_mb) << 20),
+      keyframe_interval(keyframe_interval ? keyframe_interval : 1), used(0), group_frames(0) {
+    key.resize(words);
+    scratch.resize(words);
+}
+
+void Rewind::push(const uint8_t *state) {
+    load(state);
+
+    bool keyframe = entries.empty() || group_frames == keyframe_interval;
+
+    Entry entry{keyframe, {}};
+    encode(keyframe ? nullptr : key.data(), entry.data);
+    entry.data.shrink_to_fit();
+
+    if (keyframe) {
+        key.swap(scratch);
+        group_frames = 0;
+    }
+
+    used += entry.data.size();
+    entries.push_back(move(entry));
+    ++group_frames;
+
+    while (used > budget && group_frames < entries.size())
+        drop_oldest_group();
+}
+
+bool Rewind::pop(uint8_t *state) {
+    if (entries.empty())
+        return false;
+
+    Entry &entry = entries.back();
+    decode(entry.data, entry.keyframe ? nullptr : key.data(), scratch.data());
+    memcpy(state, scratch.data(), state_size);
+
+    used -= entry.data.size();
+    bool was_keyframe = entry.keyframe;
+    entries.pop_back();
+    --group_frames;
+
+    if (was_keyframe && !entries.empty()) {
+        // continue from the previous group
+        size_t i = entries.size();
+        while (!entries[--i].keyframe)
+            ;
+        decode(entries[i].data, nullptr, key.data());
+        group_frames = entries.size() - i;
+    }
+
+    return true;
+}
+
+void Rewind::clear() {
+    entries.clear();
+    used         = 0;
+    group_frames = 0;
+}
+
+void Rewind::load(const uint8_t *state) {
+    scratch.back() = 0;
+    memcpy(scratch.data(), state, state_size);
+}
+
+void Rewind::encode(const uint64_t *base, vector<uint8_t> &out) const {
+    auto changed = [&](size_t i) { return base ? scratch[i] != base[i] : scratch[i] != 0; };
+
+    size_t i = 0;
+    while (true) {
+        size_t run_start = i;
+        while (i < words && !changed(i))
+            ++i;
+        if (i == words)
+            break;
+
+        // extend the literal run until REWIND_MERGE_WORDS unchanged words in a row
+        size_t lit_start = i, lit_end = i;
+        while (i < words && i - lit_end < REWIND_MERGE_WORDS) {
+            if (changed(i))
+                lit_end = i + 1;
+            ++i;
+        }
+        i = lit_end;
+
+        Run run{uint32_t(lit_start - run_start), uint32_t(lit_end - lit_start)};
+        size_t pos = out.size();
+        out.resize(pos + sizeof(Run) + run.len * sizeof(uint64_t));
+        memcpy(&out[pos], &run, sizeof(Run));
+        pos += sizeof(Run);
+        for (size_t w = lit_start; w < lit_end; ++w, pos += sizeof(uint64_t)) {
+            uint64_t x = base ? scratch[w] ^ base[w] : scratch[w];
+            memcpy(&out[pos], &x, sizeof(uint64_t));
+        }
+    }
+}
+
+void Rewind::decode(const vector<uint8_t> &in, const uint64_t *base, uint64_t *out) const {
+    if (base)
+        memcpy(out, base, words * sizeof(uint64_t));
+    else
+        memset(out, 0, words * sizeof(uint64_t));
+
+    size_t w = 0;
+    for (size_t pos = 0; pos < in.size();) {
+        Run run;
+        memcpy(&run, &in[pos], sizeof(Run));
+        pos += sizeof(Run);
+        w += run.skip;
+        for (uint32_t n = 0; n < run.len; ++n, ++w, pos += sizeof(uint64_t)) {
+            uint64_t x;
+            memcpy(&x, &in[pos], sizeof(uint64_t));
+            out[w] ^= x;
+        }
+    }
+}
+
+void Rewind::drop_oldest_group() {
+    do {
+        used -= entries.front().data.size();
+        entries.pop_front();
+    } while (!entries.front().keyframe);
+}
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "rom_store.h"
+
+using namespace std;
+
+static mutex store_lock;
+static map<string, weak_ptr<const RomImage>> by_path;
+static map<uint64_t, weak_ptr<const RomImage>> by_hash;
+
+static uint64_t fnv1a(const uint8_t *data, unsigned size) {
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (unsigned i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001B3u;
+    return hash;
+}
+
+static void open_failed(const string &filename) {
+    throw runtime_error("could not open ROM file " + filename);
+}
+
+// drop entries of images no Cart uses anymore
+template <typename Key> static void prune(map<Key, weak_ptr<const RomImage>> &images) {
+    for (auto it = images.begin(); it != images.end();)
+        it = it->second.expired() ? images.erase(it) : next(it);
+}
+
+RomImage::~RomImage() {
+#ifdef _WIN32
+    delete[] data;
+#else
+    munmap(data, mapped_bytes);
+#endif
+}
+
+#ifdef _WIN32
+
+static long long modification_time(const string &) {
+    return 0;
+}
+
+static RomImage *read_image(const string &filename) {
+    ifstream romfile(filename, ios::binary);
+    if (!romfile.good())
+        open_failed(filename);
+
+    romfile.seekg(0, romfile.end);
+    auto image  = new RomImage();
+    image->size = romfile.tellg();
+    romfile.seekg(0, romfile.beg);
+
+    // one spare byte for word reads at the end of the last bank
+    image->data = new uint8_t[image->size + 1]();
+    romfile.read((char *)image->data, image->size);
+    return image;
+}
+
+#else
+
+static long long modification_time(const string &filename) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+        return -1;
+    return info.st_mtime;
+}
+
+static RomImage *read_image(const string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0)
+            close(fd);
+        open_failed(filename);
+    }
+
+    // reserve a zero page past the end for word reads at the end of the last bank, then map the file over the rest
+    size_t page   = sysconf(_SC_PAGESIZE);
+    size_t length = (info.st_size + page - 1) / page * page + page;
+    void *base    = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED || mmap(base, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if (base != MAP_FAILED)
+            munmap(base, length);
+        close(fd);
+        throw runtime_error("could not map ROM file " + filename);
+    }
+    close(fd);
+
+    auto image          = new RomImage();
+    image->data         = static_cast<uint8_t *>(base);
+    image->size         = info.st_size;
+    image->mapped_bytes = length;
+    image->mtime        = info.st_mtime;
+    return image;
+}
+
+#endif
+
+shared_ptr<const RomImage> RomStore::load(const string &filename) {
+    lock_guard<mutex> guard(store_lock);
+
+    auto cached = by_path.find(filename);
+    if (cached != by_path.end()) {
+        auto image = cached->second.lock();
+        if (image && image->mtime == modification_time(filename))
+            return image;
+    }
+
+    prune(by_path);
+    prune(by_hash);
+
+    shared_ptr<RomImage> image(read_image(filename));
+    image->hash = fnv1a(image->data, image->size);
+
+    // same contents under another path
+    auto same = by_hash.find(image->hash);
+    if (same != by_hash.end()) {
+        auto existing = same->second.lock();
+        if (existing && existing->size == image->size && !memcmp(existing->data, image->data, image->size)) {
+            by_path[filename] = existing;
+            return existing;
+        }
+    }
+
+    by_path[filename]    = image;
+    by_hash[image->hash] = image;
+    return image;
+}
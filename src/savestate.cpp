@@ -0,0 +1,279 @@
+#include <array>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "savestate.h"
+#include "state.h"
+
+using namespace std;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    char title[16];       // ROM 0x0134 - 0x0143
+    uint8_t checksum[3];  // ROM header and global checksums 0x014D - 0x014F
+    uint8_t reserved;
+    uint32_t section_count;
+    uint32_t header_crc;  // CRC of the header up to this field
+};
+
+struct SectionHeader {
+    char tag[4];
+    uint32_t size;
+    uint32_t crc;
+};
+
+struct Section {
+    char tag[5];
+    size_t offset;
+    size_t size;
+};
+
+#define MEMBER(name) offsetof(MachineState, name), sizeof(MachineState::name)
+
+// fixed sections, cartridge RAM follows as "CRAM"
+static const Section sections[] = {
+    {"VRAM", MEMBER(VRAM)},  {"WRAM", MEMBER(WRAM)},   {"HRAM", MEMBER(HIGH)},    {"BIOS", MEMBER(BIOS)},
+    {"REGS", MEMBER(REG)},   {"CPU ", MEMBER(cpu)},    {"CART", MEMBER(cart)},    {"GPU ", MEMBER(gpu)},
+    {"TIMR", MEMBER(timer)}, {"SERL", MEMBER(serial)}, {"SND ", MEMBER(sound)},   {"BTN ", MEMBER(buttons)},
+    {"CLK ", MEMBER(clock_overflow)}};
+
+#define SECTION_COUNT (sizeof(sections) / sizeof(Section))
+
+static void rom_identity(FileHeader &header, const uint8_t *rom) {
+    memcpy(header.title, &rom[0x0134], sizeof(header.title));
+    memcpy(header.checksum, &rom[0x014D], sizeof(header.checksum));
+}
+
+static void append(vector<uint8_t> &out, const void *data, size_t size) {
+    out.insert(out.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+}
+
+uint32_t SaveState::crc32(const uint8_t *data, size_t size) {
+    static const auto table = [] {
+        array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+vector<uint8_t> SaveState::encode(const uint8_t *state, const uint8_t *rom) {
+    auto machine       = reinterpret_cast<const MachineState *>(state);
+    unsigned cart_size = machine->cart_ram_size;
+
+    FileHeader header{SAVESTATE_MAGIC, SAVESTATE_VERSION, {}, {}, 0, SECTION_COUNT + 1, 0};
+    rom_identity(header, rom);
+    header.header_crc = crc32(reinterpret_cast<const uint8_t *>(&header), offsetof(FileHeader, header_crc));
+
+    vector<uint8_t> out;
+    out.reserve(sizeof(FileHeader) + (SECTION_COUNT + 1) * sizeof(SectionHeader) + 0x5000 + cart_size);
+    append(out, &header, sizeof(header));
+
+    auto add_section = [&](const char *tag, const uint8_t *data, size_t size) {
+        SectionHeader section{{}, uint32_t(size), crc32(data, size)};
+        memcpy(section.tag, tag, 4);
+        append(out, &section, sizeof(section));
+        append(out, data, size);
+    };
+
+    for (const Section &s : sections)
+        add_section(s.tag, state + s.offset, s.size);
+    add_section("CRAM", state + MachineState::cart_ram_offset(), cart_size);
+
+    return out;
+}
+
+bool SaveState::decode(const vector<uint8_t> &data, MachineState &state, const uint8_t *rom) {
+    FileHeader header;
+    if (data.size() < sizeof(header)) {
+        printf("[state] file too short\n");
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (header.magic != SAVESTATE_MAGIC ||
+        header.header_crc != crc32(data.data(), offsetof(FileHeader, header_crc))) {
+        printf("[state] not a savestate file\n");
+        return false;
+    }
+    if (header.version != SAVESTATE_VERSION) {
+        printf("[state] unsupported savestate version %u\n", header.version);
+        return false;
+    }
+
+    FileHeader expected;
+    rom_identity(expected, rom);
+    if (memcmp(header.title, expected.title, sizeof(header.title)) ||
+        memcmp(header.checksum, expected.checksum, sizeof(header.checksum))) {
+        printf("[state] savestate is for a different ROM\n");
+        return false;
+    }
+
+    // apply to a copy, so a bad section leaves the running state as it was
+    vector<uint8_t> staged(state.size());
+    memcpy(staged.data(), &state, state.size());
+
+    bool found[SECTION_COUNT + 1] = {};
+    size_t pos                    = sizeof(header);
+
+    for (uint32_t i = 0; i < header.section_count; ++i) {
+        SectionHeader section;
+        if (pos + sizeof(section) > data.size()) {
+            printf("[state] truncated savestate\n");
+            return false;
+        }
+        memcpy(&section, &data[pos], sizeof(section));
+        pos += sizeof(section);
+
+        if (pos + section.size > data.size()) {
+            printf("[state] truncated savestate\n");
+            return false;
+        }
+        const uint8_t *payload = &data[pos];
+        pos += section.size;
+
+        if (crc32(payload, section.size) != section.crc) {
+            printf("[state] CRC mismatch in section %.4s\n", section.tag);
+            return false;
+        }
+
+        size_t index = 0;
+        while (index < SECTION_COUNT && memcmp(sections[index].tag, section.tag, 4))
+            ++index;
+
+        size_t offset, size;
+        if (index < SECTION_COUNT) {
+            offset = sections[index].offset;
+            size   = sections[index].size;
+        } else if (!memcmp(section.tag, "CRAM", 4)) {
+            offset = MachineState::cart_ram_offset();
+            size   = state.cart_ram_size;
+        } else {
+            // unknown sections are skipped
+            continue;
+        }
+
+        if (section.size != size) {
+            printf("[state] section %.4s has size %u, expected %zu\n", section.tag, section.size, size);
+            return false;
+        }
+
+        memcpy(&staged[offset], payload, size);
+        found[index] = true;
+    }
+
+    for (size_t index = 0; index <= SECTION_COUNT; ++index) {
+        if (!found[index]) {
+            printf("[state] missing section %.4s\n", index < SECTION_COUNT ? sections[index].tag : "CRAM");
+            return false;
+        }
+    }
+
+    // the memory hash is not stored in the file
+    reinterpret_cast<MachineState *>(staged.data())->rehash();
+
+    memcpy(&state, staged.data(), state.size());
+    return true;
+}
+
+bool SaveState::load(const string &filename, MachineState &state, const uint8_t *rom) {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+        printf("[state] could not open %s\n", filename.c_str());
+        return false;
+    }
+
+    vector<uint8_t> data;
+    uint8_t block[1 << 16];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+        data.insert(data.end(), block, block + n);
+    fclose(file);
+
+    return decode(data, state, rom);
+}
+
+bool SaveState::save(const string &filename, const uint8_t *state, const uint8_t *rom) {
+    vector<uint8_t> data = encode(state, rom);
+
+    string temp = filename + ".tmp";
+    FILE *file  = fopen(temp.c_str(), "wb");
+    bool ok     = file != nullptr && fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (file != nullptr)
+        ok = (fclose(file) == 0) && ok;
+
+    if (!ok) {
+        printf("[state] could not write %s\n", filename.c_str());
+        return false;
+    }
+    if (rename(temp.c_str(), filename.c_str()) != 0) {
+        printf("[state] could not replace %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+string SaveState::slot_filename(unsigned slot) {
+    return "gbe" + to_string(slot) + ".state";
+}
+
+SaveStateWriter::SaveStateWriter() : busy(false), stopping(false) {
+    writer = thread(&SaveStateWriter::writer_loop, this);
+}
+
+SaveStateWriter::~SaveStateWriter() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+}
+
+void SaveStateWriter::save(const string &filename, const MachineState &state, const uint8_t *rom) {
+    auto begin = reinterpret_cast<const uint8_t *>(&state);
+    Job job{filename, vector<uint8_t>(begin, begin + state.size()), rom};
+
+    {
+        lock_guard<mutex> guard(lock);
+        jobs.push_back(move(job));
+    }
+    cond.notify_all();
+}
+
+void SaveStateWriter::flush() {
+    unique_lock<mutex> guard(lock);
+    cond.wait(guard, [this] { return jobs.empty() && !busy; });
+}
+
+void SaveStateWriter::writer_loop() {
+    unique_lock<mutex> guard(lock);
+
+    while (true) {
+        cond.wait(guard, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+            return;
+
+        Job job = move(jobs.front());
+        jobs.pop_front();
+        busy = true;
+        guard.unlock();
+
+        SaveState::save(job.filename, job.state.data(), job.rom);
+
+        guard.lock();
+        busy = false;
+        cond.notify_all();
+    }
+}
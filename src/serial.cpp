@@ -20,11 +20,49 @@ void SerialPortInterface::finish() {
     *MEM.IF |= SERIAL_INT;
 
     transfer_callback(*MEM.SB);
+    if (capturing)
+        record(*MEM.SB);
 
     // receive 0xFF when not connected
     *MEM.SB = 0xFF;
 }
 
+void SerialPortInterface::capture(const std::vector<std::string> &patterns, size_t max_bytes) {
+    capturing       = true;
+    this->patterns  = patterns;
+    this->max_bytes = max_bytes;
+    output.clear();
+    match = -1;
+}
+
+void SerialPortInterface::copy_capture(const SerialPortInterface &other) {
+    capturing = other.capturing;
+    patterns  = other.patterns;
+    max_bytes = other.max_bytes;
+    output    = other.output;
+    match     = other.match;
+}
+
+void SerialPortInterface::record(uint8_t byte) {
+    output.push_back(byte);
+
+    // bytes arrive one at a time, so a new match can only end at the last one
+    if (match < 0) {
+        for (unsigned i = 0; i < patterns.size(); ++i) {
+            const std::string &pattern = patterns[i];
+            if (!pattern.empty() && output.size() >= pattern.size() &&
+                output.compare(output.size() - pattern.size(), pattern.size(), pattern) == 0) {
+                match = i;
+                break;
+            }
+        }
+    }
+
+    // trim in batches so long outputs are not shifted on every byte
+    if (max_bytes && output.size() >= 2 * max_bytes)
+        output.erase(0, output.size() - max_bytes);
+}
+
 void SerialPortInterface::update(unsigned tclocks) {
     if (*MEM.SC & START) {
 
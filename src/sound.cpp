@@ -1,6 +1,10 @@
 #include "sound.h"
+#include "audio_capture.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <limits>
 
 #define NR10_ADDR 0xFF10
@@ -37,6 +41,12 @@
 #define WAVE_ADDR     0xFF30
 #define WAVE_RAM_SIZE 16
 
+#define LFSR15_PERIOD 32767u
+#define LFSR7_PERIOD  127u
+#define NOISE_MAX_SHIFT 13u // NR43 clock shifts 14 and 15 stop the LFSR
+// steps after which both noise sequences repeat, 127 is prime
+#define LFSR_INDEX_PERIOD (LFSR15_PERIOD * LFSR7_PERIOD)
+
 enum direction : uint8_t { Decrease, Increase };
 
 #define ENV_REGISTERS(name)                                                                                            \
@@ -238,7 +248,76 @@ struct CTRL {
 };
 static_assert((sizeof(CTRL) == 3));
 
-Sound::Sound() {
+// Tables shared by all Sound instances, built once on first use
+struct WaveTables {
+    // square wave output low/high per duty setting and step
+    bool duty_low[4][32];
+
+    // noise channel output low/high after each LFSR step since trigger, bit-packed
+    uint8_t lfsr15_low[(LFSR15_PERIOD + 7) / 8];
+    uint8_t lfsr7_low[(LFSR7_PERIOD + 7) / 8];
+
+    // noise channel tclocks per LFSR step, indexed by (shift_clk_freq << 3) | freq_div
+    unsigned noise_period[128];
+
+    WaveTables() {
+        const unsigned duty_map[4]{4, 8, 16, 24};
+        for (unsigned duty = 0; duty < 4; ++duty)
+            for (unsigned step = 0; step < 32; ++step)
+                duty_low[duty][step] = step > duty_map[duty];
+
+        generate_lfsr(lfsr15_low, LFSR15_PERIOD, 15);
+        generate_lfsr(lfsr7_low, LFSR7_PERIOD, 7);
+
+        // the LFSR is clocked every divisor << shift tclocks (524288 Hz / r / 2^(s+1), with r = 0 counting as 0.5)
+        const uint8_t divisor_lookup[8]{8, 16, 32, 48, 64, 80, 96, 112};
+        for (unsigned shift = 0; shift < 16; ++shift) {
+            for (unsigned div = 0; div < 8; ++div) {
+                noise_period[(shift << 3) | div] =
+                    shift <= NOISE_MAX_SHIFT ? unsigned(divisor_lookup[div]) << shift : UINT32_MAX;
+            }
+        }
+    }
+
+    static void generate_lfsr(uint8_t *bits, unsigned period, unsigned width) {
+        memset(bits, 0, (period + 7) / 8);
+        // initialized with all 1-bits on trigger
+        unsigned counter = (1u << width) - 1;
+        for (unsigned i = 0; i < period; ++i) {
+            // feedback bit is bit0 xor bit1, shifted in at the top
+            unsigned feedback = (counter ^ (counter >> 1)) & 1;
+            counter           = (counter >> 1) | (feedback << (width - 1));
+            // output is inverted 0-bit of counter
+            if (~counter & 1)
+                bits[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    bool noise_low(unsigned index, bool short_mode) const {
+        if (short_mode)
+            index %= LFSR7_PERIOD;
+        else
+            index %= LFSR15_PERIOD;
+        const uint8_t *bits = short_mode ? lfsr7_low : lfsr15_low;
+        return (bits[index >> 3] >> (index & 7)) & 1;
+    }
+};
+
+static const WaveTables &wave_tables() {
+    static const WaveTables tables;
+    return tables;
+}
+
+bool Sound::noiseLow(unsigned index, bool short_mode) {
+    return wave_tables().noise_low(index, short_mode);
+}
+
+Sound::Sound(SoundState &StateRef)
+    : state(StateRef), sample_ready(StateRef.sample_ready), clock(StateRef.clock), lsample(StateRef.lsample),
+      rsample(StateRef.rsample), mem(StateRef.mem), internal_256hz_counter(StateRef.internal_256hz_counter) {
+
+    internal_256hz_counter = TCLK_HZ / 256;
+
     // initialize waveforms
     sample_t max_sample = std::numeric_limits<sample_t>::max() / 4;
     sample_t min_sample = std::numeric_limits<sample_t>::min() / 4;
@@ -252,6 +331,21 @@ Sound::Sound() {
     }
 }
 
+Sound::~Sound() {
+    stopCapture();
+}
+
+void Sound::startCapture(const std::string &filename, bool channel_stems) {
+    stopCapture();
+    capture = new AudioCapture(filename, channel_stems);
+}
+
+void Sound::stopCapture() {
+    // flushes remaining samples and closes the files
+    delete capture;
+    capture = nullptr;
+}
+
 void Sound::clearRegisters() {
     for (uint16_t i = NR10_ADDR; i < WAVE_ADDR; i++) {
         mem[i - REG_OFFSET] = 0;
@@ -364,9 +458,54 @@ void Sound::update(unsigned tclk) {
         // TODO: volume control
         lsample = Control->SO1_vol ? sample_t(lsample) : 0;
         rsample = Control->SO2_vol ? sample_t(rsample) : 0;
+
+        if (capture) {
+            const sample_t channels[4]{ch1_sample, ch2_sample, ch3_sample, ch4_sample};
+            capture->push(lsample, rsample, channels);
+        }
+
+        if (track_features) {
+            square_sums[0] += float(ch1_sample) * ch1_sample;
+            square_sums[1] += float(ch2_sample) * ch2_sample;
+            square_sums[2] += float(ch3_sample) * ch3_sample;
+            square_sums[3] += float(ch4_sample) * ch4_sample;
+            feature_samples++;
+        }
     }
 }
 
+void Sound::getFeatures(float *out) {
+    auto Channel1 = reinterpret_cast<CH1 *>(mem + (NR10_ADDR - REG_OFFSET));
+    auto Channel2 = reinterpret_cast<CH2 *>(mem + (NR21_ADDR - REG_OFFSET));
+    auto Channel3 = reinterpret_cast<CH3 *>(mem + (NR30_ADDR - REG_OFFSET));
+    auto Channel4 = reinterpret_cast<CH4 *>(mem + (NR41_ADDR - REG_OFFSET));
+    auto Control  = reinterpret_cast<CTRL *>(mem + (NR50_ADDR - REG_OFFSET));
+
+    const unsigned frequency[4]{
+        (unsigned(Channel1->freq_hi) << 8) | Channel1->freq_lo, (unsigned(Channel2->freq_hi) << 8) | Channel2->freq_lo,
+        (unsigned(Channel3->freq_hi) << 8) | Channel3->freq_lo, Channel4->NR43};
+
+    // wave channel volume is an output level code: 0%, 100%, 50%, 25%
+    const static float wave_volume[4]{0.0f, 1.0f, 0.5f, 0.25f};
+
+    const uint8_t volume[4]{state.ch1.vol, state.ch2.vol, state.ch3.vol, state.ch4.vol};
+
+    const float max_level = std::numeric_limits<sample_t>::max() / 4;
+
+    for (unsigned ch = 0; ch < 4; ++ch) {
+        float *features = &out[ch * AUDIO_FEATURES_PER_CHANNEL];
+
+        features[0] = float((Control->NR52 >> ch) & 1);
+        features[1] = float(frequency[ch]);
+        features[2] = (ch == 2) ? wave_volume[volume[ch] & 3] : volume[ch] / 15.0f;
+        features[3] = feature_samples ? std::sqrt(square_sums[ch] / feature_samples) / max_level : 0.0f;
+
+        square_sums[ch] = 0;
+    }
+
+    feature_samples = 0;
+}
+
 bool Sound::hasNewSample() {
     return sample_ready;
 }
@@ -382,20 +521,20 @@ sample_t Sound::updateCh1(unsigned tclock, bool length_tick) {
     auto Channel1 = reinterpret_cast<CH1 *>(mem + (NR10_ADDR-REG_OFFSET));
     auto Control  = reinterpret_cast<CTRL *>(mem + (NR50_ADDR-REG_OFFSET));
 
-    static unsigned freq_clock = 0;
+    unsigned &freq_clock = state.ch1.freq_clock;
 
     freq_clock += tclock;
 
-    static unsigned ctr        = 0;
-    static unsigned env_step   = 0;
-    static unsigned env_ctr    = 0;
-    static unsigned sweep_ctr  = 0;
-    static unsigned sweep_step = 0;
-    static unsigned sweep_freq = 0;
+    unsigned &ctr        = state.ch1.ctr;
+    unsigned &env_step   = state.ch1.env_step;
+    unsigned &env_ctr    = state.ch1.env_ctr;
+    unsigned &sweep_ctr  = state.ch1.sweep_ctr;
+    unsigned &sweep_step = state.ch1.sweep_step;
+    unsigned &sweep_freq = state.ch1.sweep_freq;
 
-    static uint8_t vol = 0;
+    uint8_t &vol = state.ch1.vol;
 
-    static sample_t sample = 0;
+    sample_t &sample = state.ch1.sample;
 
     if (Channel1->timed_mode && length_tick) {
         Channel1->sound_length++;
@@ -434,14 +573,13 @@ sample_t Sound::updateCh1(unsigned tclock, bool length_tick) {
         // waveform control
         unsigned gb_freq = 2048 - (unsigned(Channel1->freq_lo) + (unsigned(Channel1->freq_hi) << 8));
         if (freq_clock >= gb_freq) {
-            freq_clock -= gb_freq;
-
             // gb_freq = frequency in tclocks / 32
             // i.e. 32 ticks per wavelength
+            unsigned steps = freq_clock / gb_freq;
+            freq_clock -= steps * gb_freq;
+            ctr = (ctr + steps) % 32;
 
-            const static unsigned duty_map[4]{4, 8, 16, 24};
-
-            bool low = ((++ctr) % 32) > duty_map[Channel1->wave_duty];
+            bool low = wave_tables().duty_low[Channel1->wave_duty][ctr];
 
             sample = low ? square_map[16 + vol] : square_map[16 - vol];
         }
@@ -496,17 +634,17 @@ sample_t Sound::updateCh2(unsigned tclock, bool length_tick) {
     auto Channel2 = reinterpret_cast<CH2 *>(mem + (NR21_ADDR-REG_OFFSET));
     auto Control  = reinterpret_cast<CTRL *>(mem + (NR50_ADDR-REG_OFFSET));
 
-    static unsigned freq_clock = 0;
+    unsigned &freq_clock = state.ch2.freq_clock;
 
     freq_clock += tclock;
 
-    static unsigned ctr      = 0;
-    static unsigned env_step = 0;
-    static unsigned env_ctr  = 0;
+    unsigned &ctr      = state.ch2.ctr;
+    unsigned &env_step = state.ch2.env_step;
+    unsigned &env_ctr  = state.ch2.env_ctr;
 
-    static uint8_t vol = 0;
+    uint8_t &vol = state.ch2.vol;
 
-    static sample_t sample = 0;
+    sample_t &sample = state.ch2.sample;
 
     if (Channel2->timed_mode && length_tick) {
         Channel2->sound_length++;
@@ -539,14 +677,13 @@ sample_t Sound::updateCh2(unsigned tclock, bool length_tick) {
         // waveform control
         unsigned gb_freq = 2048 - (unsigned(Channel2->freq_lo) + (unsigned(Channel2->freq_hi) << 8));
         if (freq_clock >= gb_freq) {
-            freq_clock -= gb_freq;
-
             // gb_freq = frequency in tclocks / 32
             // i.e. 32 ticks per wavelength
+            unsigned steps = freq_clock / gb_freq;
+            freq_clock -= steps * gb_freq;
+            ctr = (ctr + steps) % 32;
 
-            const static float duty_map[4]{4, 8, 16, 24};
-
-            bool low = ((++ctr) % 32) > duty_map[Channel2->wave_duty];
+            bool low = wave_tables().duty_low[Channel2->wave_duty][ctr];
 
             sample = low ? square_map[16 + vol] : square_map[16 - vol];
         }
@@ -579,12 +716,12 @@ sample_t Sound::updateCh3(unsigned tclock, bool length_tick) {
     auto Channel3 = reinterpret_cast<CH3 *>(mem + (NR30_ADDR-REG_OFFSET));
     auto Control  = reinterpret_cast<CTRL *>(mem + (NR50_ADDR-REG_OFFSET));
 
-    static unsigned freq_clock = 0;
-    static uint8_t index       = 0;
+    unsigned &freq_clock = state.ch3.freq_clock;
+    uint8_t &index       = state.ch3.index;
 
     freq_clock += tclock;
 
-    static uint8_t vol = 0;
+    uint8_t &vol = state.ch3.vol;
 
     if (Channel3->timed_mode && length_tick) {
         Channel3->sound_length++;
@@ -608,19 +745,23 @@ sample_t Sound::updateCh3(unsigned tclock, bool length_tick) {
         Control->CH3_on = 0;
     }
 
-    static sample_t sample = 0;
+    sample_t &sample = state.ch3.sample;
 
     unsigned gb_freq = 2048 - (unsigned(Channel3->freq_lo) + (unsigned(Channel3->freq_hi) << 8));
     gb_freq          = gb_freq * TCLK_HZ / 65536; // sample played at freq * 65536 hz
 
-    if (freq_clock >= gb_freq / 32) {
-        freq_clock -= gb_freq / 32;
+    // tclocks per wave RAM sample
+    unsigned period = std::max(gb_freq / 32, 1u);
+
+    if (freq_clock >= period) {
+        unsigned steps = freq_clock / period;
+        freq_clock -= steps * period;
 
         if (Control->CH3_on && Channel3->dac_on) {
-            index = (index + 1) % 32;
+            index = (index + steps) % 32;
 
             // 4-bit samples played high bits first
-            uint8_t wave_sample = mem[WAVE_ADDR + ((31 - index) >> 1)];
+            uint8_t wave_sample = mem[WAVE_ADDR - REG_OFFSET + ((31 - index) >> 1)];
             // (index flip changes parity!)
             if (!(index % 2))
                 wave_sample &= 0x0F; // low 4 bytes
@@ -648,18 +789,21 @@ sample_t Sound::updateCh4(unsigned tclock, bool length_tick) {
     auto Channel4 = reinterpret_cast<CH4 *>(mem + (NR41_ADDR-REG_OFFSET));
     auto Control  = reinterpret_cast<CTRL *>(mem + (NR50_ADDR-REG_OFFSET));
 
-    static unsigned freq_clock = 0;
+    unsigned &freq_clock = state.ch4.freq_clock;
 
     freq_clock += tclock;
 
-    static unsigned env_step = 0;
-    static unsigned env_ctr  = 0;
+    unsigned &env_step = state.ch4.env_step;
+    unsigned &env_ctr  = state.ch4.env_ctr;
 
-    static uint16_t counter = 0;
+    // LFSR steps since trigger, wrapped at LFSR_INDEX_PERIOD. Both widths read the same index, so switching
+    // the NR43 width mid-note continues at that step of the other sequence. Hardware keeps one shift
+    // register and continues from its current bits instead; the phase after a switch is approximate.
+    unsigned &lfsr_index = state.ch4.lfsr_index;
 
-    static uint8_t vol = 0;
+    uint8_t &vol = state.ch4.vol;
 
-    static sample_t sample = 0;
+    sample_t &sample = state.ch4.sample;
 
     if (Channel4->timed_mode && length_tick) {
         Channel4->sound_length++;
@@ -684,46 +828,22 @@ sample_t Sound::updateCh4(unsigned tclock, bool length_tick) {
         vol      = Channel4->env_start;
 
         Control->CH4_on = 1;
-        // initialize counter with 15 1-bits
-        counter = (1 << 15) - 1;
+        // first step reads sequence index 0
+        lfsr_index = LFSR_INDEX_PERIOD - 1;
     }
 
     if (Control->CH4_on) {
-        // compute frequency
-        const static uint8_t divisor_lookup[8]{8, 16, 32, 48, 64, 80, 96, 112};
-
-        unsigned counter_clk = (TCLK_HZ / 8) / divisor_lookup[Channel4->freq_div];
-        unsigned gb_freq     = counter_clk >> (Channel4->shift_clk_freq + 1);
-
-        gb_freq >>= 4; // TODO: magic constant --- fixme
+        // tclocks per LFSR step
+        unsigned gb_freq = wave_tables().noise_period[(Channel4->shift_clk_freq << 3) | Channel4->freq_div];
 
         if (freq_clock >= gb_freq) {
-            freq_clock -= gb_freq;
-
-            // feedback bit is bit0 xor bit1
-            bool feedback = bool(counter & 2) ^ bool(counter & 1);
-            // shift right
-            counter >>= 1;
-
-            if (feedback) {
-                // feedback xor to bit 14
-                counter &= ~(1 << 14);
-                counter |= (1 << 14);
-
-                // also feedback to bit 6?
-                if (Channel4->counter_step) {
-                    counter &= ~(1 << 6);
-                    counter |= (1 << 6);
-                }
-            }
+            unsigned steps = freq_clock / gb_freq;
+            freq_clock -= steps * gb_freq;
+            lfsr_index = (lfsr_index + steps) % LFSR_INDEX_PERIOD;
 
-            // output is inverted 0-bit of counter
-            bool low = ~counter & 1;
+            bool low = wave_tables().noise_low(lfsr_index, Channel4->counter_step);
 
             sample = low ? square_map[16 - vol] : square_map[16 + vol];
-
-            // printf("%02X %02X %02X %02X\n", Channel4->NR41,
-            //	Channel4->NR42, Channel4->NR43, Channel4->NR44);
         }
 
         // volume sweep control
@@ -0,0 +1,49 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "state.h"
+
+MachineState *MachineState::create(unsigned cart_ram_size) {
+    auto state           = static_cast<MachineState *>(calloc(1, cart_ram_offset() + cart_ram_size));
+    state->cart_ram_size = cart_ram_size;
+    return state;
+}
+
+MachineState *MachineState::fork(const MachineState &parent) {
+    auto state = static_cast<MachineState *>(malloc(parent.size()));
+
+    // OAM, IO and HRAM are written every cycle, copy them along with the rest of the struct
+    auto begin = reinterpret_cast<const uint8_t *>(&parent.HIGH);
+    auto end   = reinterpret_cast<const uint8_t *>(&parent) + cart_ram_offset();
+    memcpy(&state->HIGH, begin, end - begin);
+
+    return state;
+}
+
+void MachineState::destroy(MachineState *state) {
+    free(state);
+}
+
+void MachineState::rehash() {
+    auto bytes  = reinterpret_cast<const uint8_t *>(this);
+    memory_hash = 0;
+    for (size_t offset = 0; offset < offsetof(MachineState, HIGH); ++offset)
+        memory_hash ^= state_byte_key(offset, bytes[offset]);
+    for (size_t offset = cart_ram_offset(); offset < size(); ++offset)
+        memory_hash ^= state_byte_key(offset, bytes[offset]);
+}
+
+uint64_t MachineState::hash() const {
+    auto bytes = reinterpret_cast<const uint8_t *>(this);
+    uint64_t h = memory_hash;
+
+    // everything between the hashed regions, memory_hash included
+    for (size_t offset = offsetof(MachineState, HIGH); offset < cart_ram_offset(); offset += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + offset, sizeof(word));
+        h = (h ^ word) * 0x100000001B3u;
+        h ^= h >> 29;
+    }
+
+    return mix64(h);
+}
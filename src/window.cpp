@@ -5,6 +5,7 @@
 #include "buttons.h"
 #include "mem.h"
 #include "openal_output.h"
+#include "savestate.h"
 #include "sound.h"
 #include "sync.h"
 #include "window.h"
@@ -46,6 +47,13 @@ void Window::poll_buttons() {
     if (glfwGetKey(game_window, GLFW_KEY_F4) == GLFW_PRESS)
         SND.mute_ch4 = glfwGetKey(game_window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS;
 
+    for (unsigned slot = 1; slot <= SAVESTATE_SLOTS; ++slot) {
+        if (glfwGetKey(game_window, GLFW_KEY_1 + slot - 1) == GLFW_PRESS && state_slot != slot) {
+            state_slot = slot;
+            printf("[state] slot %u\n", slot);
+        }
+    }
+
     if (glfwGetKey(game_window, GLFW_KEY_F5) == GLFW_PRESS && !f5_down) {
         f5_down = true;
     }
@@ -61,6 +69,35 @@ void Window::poll_buttons() {
         load_state = true;
         f6_down    = false;
     }
+
+    rewind = glfwGetKey(game_window, GLFW_KEY_BACKSPACE) == GLFW_PRESS;
+
+    if (glfwGetKey(game_window, GLFW_KEY_TAB) == GLFW_PRESS && !tab_down) {
+        tab_down = true;
+    }
+    if (glfwGetKey(game_window, GLFW_KEY_TAB) == GLFW_RELEASE && tab_down) {
+        tab_down = false;
+        turbo    = !turbo;
+        if (!turbo)
+            resync();
+    }
+}
+
+void Window::resync() {
+    // continue frame rate sync from the current frame instead of catching up to wall time
+    SyncTimer::get().start();
+    SyncTimer::get().offset = state.frames * 10000 / 597;
+}
+
+void Window::pace(unsigned long long cycles) {
+    long long expected_time_ms = cycles * 10000 / (597 * 70224ull);
+    long long actual_time_ms   = SyncTimer::get().elapsed_ms();
+
+    long long delta_ms = expected_time_ms - actual_time_ms;
+
+    if (delta_ms > 0) {
+        this_thread::sleep_for(milliseconds(delta_ms));
+    }
 }
 
 void Window::scale_buffer(uint8_t *source, uint8_t *target, unsigned w, unsigned h, unsigned scale) {
@@ -85,7 +122,7 @@ void Window::scale_buffer(uint8_t *source, uint8_t *target, unsigned w, unsigned
 void Window::draw_buffer() {
 
     // copy gbe buffer to window buffer
-    scale_buffer(GPU.lcd_buffer.data(), game_window_buffer, LCD_W, LCD_H, game_scale);
+    scale_buffer(GPU.lcd_rgb(), game_window_buffer, LCD_W, LCD_H, game_scale);
 
     // draw
     poll_buttons();
@@ -128,23 +165,23 @@ void Window::draw_tileset() {
 }
 
 void Window::update(unsigned tclock) {
+    const unsigned slice_clk = 70224 / SYNC_SLICES;
+
+    unsigned long slice = state.sync_clk / slice_clk;
     state.sync_clk += tclock;
 
-    // synchronize gpu to 59.7 fps
+    // synchronize to 59.7 fps, a few times per frame so audio is produced in short bursts
+    if (!turbo && !unlocked_frame_rate && state.sync_clk / slice_clk != slice)
+        pace(state.frames * 70224ull + state.sync_clk);
+
     if (state.sync_clk >= 70224 || unlocked_frame_rate) {
         state.sync_clk -= 70224;
         ++state.frames;
 
-        long long expected_time_ms = state.frames * 10000 / 597;
-        long long actual_time_ms   = SyncTimer::get().elapsed_ms();
-
-        long long delta_ms = expected_time_ms - actual_time_ms;
-
-        if (delta_ms > 0) {
-            // printf("[window] %lld ms frame time delta\n", delta_ms);
-            this_thread::sleep_for(milliseconds(delta_ms));
-        } else {
-            // printf("[window] render lagging by %ld ms\n", delta_ms);
+        if (turbo && state.frames % turbo_skip != 0) {
+            // only present every turbo_skip-th frame, but keep reading input
+            poll_buttons();
+            return;
         }
 
         draw_buffer();
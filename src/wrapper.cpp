@@ -1,14 +1,274 @@
+#include <chrono>
+
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "condition.h"
+#include "env_server.h"
+#include "frame_pipeline.h"
 #include "gbe.h"
+#include "gbe_pool.h"
+#include "observation.h"
 
 namespace py = pybind11;
 
+typedef py::array_t<uint8_t, py::array::c_style | py::array::forcecast> byte_array;
+
+// schema from a list of fields: an address (one byte), or a tuple (address, "u8" | "u16le"),
+// (address, "bcd" | "bcdle", bytes) or (address, "bits", shift, width)
+static ObservationSchema parse_schema(const py::list &fields) {
+    ObservationSchema schema;
+
+    for (py::handle item : fields) {
+        if (py::isinstance<py::int_>(item)) {
+            schema.add_u8(item.cast<uint16_t>());
+            continue;
+        }
+
+        py::tuple field  = item.cast<py::tuple>();
+        uint16_t addr    = field[0].cast<uint16_t>();
+        std::string type = field.size() > 1 ? field[1].cast<std::string>() : "u8";
+        auto arg         = [&](size_t i) {
+            if (field.size() <= i)
+                throw py::value_error("missing argument for " + type + " field");
+            return field[i].cast<unsigned>();
+        };
+
+        if (type == "u8") {
+            schema.add_u8(addr);
+        } else if (type == "u16le") {
+            schema.add_u16le(addr);
+        } else if (type == "bcd" || type == "bcdle") {
+            unsigned bytes = arg(2);
+            if (bytes < 1 || bytes > 4)
+                throw py::value_error("bcd fields are 1 to 4 bytes");
+            schema.add_bcd(addr, bytes, type == "bcdle");
+        } else if (type == "bits") {
+            unsigned shift = arg(2), width = arg(3);
+            if (width < 1 || shift + width > 8)
+                throw py::value_error("bits field must lie within one byte");
+            schema.add_bits(addr, shift, width);
+        } else {
+            throw py::value_error("unknown field type " + type);
+        }
+    }
+    return schema;
+}
+
+// condition from a list of groups of tests (or a single group): (address, "eq" | "gt", value),
+// (address, "changes") or (address, "bit", bit). A group holds when all its tests do.
+static RunCondition parse_condition(const py::list &groups, const std::string &every) {
+    RunCondition condition;
+
+    if (every == "instruction")
+        condition.check_every = RunCondition::INSTRUCTION;
+    else if (every == "scanline")
+        condition.check_every = RunCondition::SCANLINE;
+    else if (every != "frame")
+        throw py::value_error("every must be \"instruction\", \"scanline\" or \"frame\"");
+
+    bool single = groups.size() > 0 && py::isinstance<py::tuple>(groups[0]);
+
+    for (py::handle group : single ? py::list(py::make_tuple(groups)) : groups) {
+        for (py::handle item : group.cast<py::list>()) {
+            py::tuple test   = item.cast<py::tuple>();
+            uint16_t addr    = test[0].cast<uint16_t>();
+            std::string type = test[1].cast<std::string>();
+
+            if (type == "changes") {
+                condition.changes(addr);
+                continue;
+            }
+            if (test.size() < 3)
+                throw py::value_error("missing value for " + type + " test");
+            unsigned value = test[2].cast<unsigned>();
+
+            if (type == "eq")
+                condition.equals(addr, value);
+            else if (type == "gt")
+                condition.exceeds(addr, value);
+            else if (type == "bit" && value < 8)
+                condition.bit_set(addr, value);
+            else
+                throw py::value_error("unknown test " + type);
+        }
+        condition.alternative();
+    }
+    return condition;
+}
+
+// pipeline for crop (top, left, height, width) and size (height, width), nullptr when nothing would change
+static std::unique_ptr<FramePipeline> make_pipeline(py::object crop, py::object size, bool grayscale, unsigned stack) {
+    unsigned top = 0, left = 0, crop_height = LCD_H, crop_width = LCD_W;
+    if (!crop.is_none()) {
+        auto c = crop.cast<std::array<unsigned, 4>>();
+        top = c[0], left = c[1], crop_height = c[2], crop_width = c[3];
+        if (crop_height == 0 || crop_width == 0 || top + crop_height > LCD_H || left + crop_width > LCD_W)
+            throw py::value_error("crop must lie within the 144 x 160 screen");
+    }
+
+    unsigned height = crop_height, width = crop_width;
+    if (!size.is_none()) {
+        auto s = size.cast<std::array<unsigned, 2>>();
+        height = s[0], width = s[1];
+        if (height == 0 || width == 0)
+            throw py::value_error("size must be positive");
+    }
+    if (stack == 0)
+        throw py::value_error("stack must be at least 1");
+
+    if (crop.is_none() && size.is_none() && !grayscale && stack == 1)
+        return nullptr;
+    return std::unique_ptr<FramePipeline>(
+        new FramePipeline(top, left, crop_height, crop_width, height, width, grayscale, stack)
+    );
+}
+
+// numpy shape of one observation: (stack, height, width) with a pipeline, (144, 160) without
+static std::vector<size_t> observation_shape(const FramePipeline *pipeline) {
+    if (pipeline == nullptr)
+        return {LCD_H, LCD_W};
+    return {pipeline->stack, pipeline->height, pipeline->width};
+}
+
+// KEY_* mask of an action (up, down, left, right, a, b, start, select)
+static uint8_t action_mask(const byte_array &action) {
+    if (action.size() != POOL_BUTTONS)
+        throw py::value_error("action must have 8 elements");
+    const uint8_t *a = action.data();
+    return gbe::button_mask(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+}
+
+// start of a buffer (bytes, bytearray, memoryview, numpy array) holding at least size bytes in C order
+static uint8_t *state_buffer(const py::buffer_info &info, size_t size) {
+    ssize_t stride = info.itemsize;
+    for (ssize_t dim = info.ndim - 1; dim >= 0; --dim) {
+        if (info.shape[dim] > 1 && info.strides[dim] != stride)
+            throw py::value_error("state buffer must be contiguous");
+        stride *= info.shape[dim];
+    }
+    if (size_t(info.size * info.itemsize) < size)
+        throw py::value_error("state buffer is too small");
+    return static_cast<uint8_t *>(info.ptr);
+}
+
+// (observation, done) after a step
+static py::tuple step_result(gbe &g, bool running) {
+    py::array_t<uint8_t> observation(observation_shape(g.observation_pipeline()));
+    g.write_observation(observation.mutable_data());
+    return py::make_tuple(observation, !running);
+}
+
+// pending step_async of a GBE or VecGBE: poll ready(), block in wait(), or await it
+struct StepHandle {
+    py::object owner; // keeps the stepped object alive
+    std::function<bool()> is_ready;
+    std::function<void()> block; // called without the GIL
+    std::function<py::object()> result;
+
+    // the last copy of a std::async future blocks until the step is done, don't hold the GIL meanwhile
+    ~StepHandle() {
+        py::gil_scoped_release release;
+        is_ready = nullptr;
+        block    = nullptr;
+    }
+
+    py::object wait() {
+        {
+            py::gil_scoped_release release;
+            block();
+        }
+        return result();
+    }
+};
+
+// GbePool with its outputs preallocated once, every step or reset overwrites the same arrays
+struct VecGBE {
+    GbePool pool;
+    py::array_t<uint8_t> screens;
+    py::array_t<int32_t> ram;
+    py::array_t<uint8_t> done;
+    std::vector<uint8_t> actions; // input of a pending step_async
+
+    VecGBE(const std::string &romfile, unsigned num_envs, const py::list &watch, unsigned threads)
+        : pool(romfile, num_envs, threads), screens(std::vector<size_t>{num_envs, LCD_H, LCD_W}),
+          ram(std::vector<size_t>{num_envs, watch.size()}), done(std::vector<size_t>{num_envs}) {
+        pool.watch(parse_schema(watch));
+        std::fill(ram.mutable_data(), ram.mutable_data() + ram.size(), 0);
+        std::fill(done.mutable_data(), done.mutable_data() + num_envs, 0);
+    }
+
+    // (num_envs,) mask from a Python object, nullptr for None
+    const uint8_t *mask(py::object selected, byte_array &storage) {
+        if (selected.is_none())
+            return nullptr;
+        storage = selected.cast<byte_array>();
+        if (storage.ndim() != 1 || size_t(storage.shape(0)) != pool.size())
+            throw py::value_error("mask must have shape (num_envs,)");
+        return storage.data();
+    }
+};
+
+// client of a gbe_server. The outputs are strided views of the slots in shared memory, valid until the next
+// request.
+struct ServerClient {
+    std::unique_ptr<ServerChannel> channel;
+
+    explicit ServerClient(const std::string &name) : channel(ServerChannel::attach(name)) {
+        if (!channel)
+            throw std::runtime_error("could not connect to gbe_server at " + name);
+    }
+
+    // (envs,) + shape view of a slot member at offset
+    template <typename T> py::array_t<T> view(py::object self, size_t offset, std::vector<py::ssize_t> shape) {
+        std::vector<py::ssize_t> strides(shape.size());
+        py::ssize_t stride = sizeof(T);
+        for (size_t i = shape.size(); i-- > 0;) {
+            strides[i] = stride;
+            stride *= shape[i];
+        }
+        shape.insert(shape.begin(), channel->size());
+        strides.insert(strides.begin(), channel->header->slot_size);
+
+        T *data = reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(&channel->slot(0)) + offset);
+        return py::array_t<T>(shape, strides, data, self);
+    }
+
+    // submit command to the environments selected by mask (None for all) and wait for them
+    void run(uint32_t command, py::object mask, const uint8_t *buttons = nullptr, uint32_t repeat = 1) {
+        byte_array storage;
+        const uint8_t *selected = nullptr;
+        if (!mask.is_none()) {
+            storage = mask.cast<byte_array>();
+            if (storage.ndim() != 1 || size_t(storage.shape(0)) != channel->size())
+                throw py::value_error("mask must have shape (num_envs,)");
+            selected = storage.data();
+        }
+
+        py::gil_scoped_release release;
+        for (unsigned env = 0; env < channel->size(); ++env)
+            if (!selected || selected[env])
+                channel->submit(env, command, buttons ? buttons[env] : 0, repeat);
+        channel->wait_all();
+    }
+};
+
 PYBIND11_MODULE(libgbe, m) {
-    py::class_<gbe>(m, "GBE")
-        .def(py::init<std::string>())
+    py::class_<gbe> gbe_class(m, "GBE");
+
+    py::enum_<gbe::run_result>(gbe_class, "RunResult")
+        .value("CONDITION_MET", gbe::CONDITION_MET)
+        .value("TIMEOUT", gbe::TIMEOUT)
+        .value("STUCK", gbe::STUCK);
+
+    gbe_class
+        .def(
+            py::init([](std::string romfile, bool battery_save) {
+                return new gbe(romfile, [](uint8_t) {}, battery_save);
+            }),
+            py::arg("romfile"), py::arg("battery_save") = false
+        )
         .def(
             "display",
             [](gbe &g) {
@@ -17,6 +277,340 @@ PYBIND11_MODULE(libgbe, m) {
         )
         .def("run", &gbe::run)
         .def("run_to_vblank", &gbe::run_to_vblank)
+        .def(
+            "run_until",
+            // run until the condition holds (see parse_condition) or a limit is reached, returns a RunResult
+            [](gbe &g, const py::list &condition, long max_cycles, const std::string &every, unsigned max_frames) {
+                RunCondition compiled = parse_condition(condition, every);
+                py::gil_scoped_release release;
+                return g.run_until(compiled, max_cycles, max_frames);
+            },
+            py::arg("condition"), py::arg("max_cycles"), py::arg("every") = "frame", py::arg("max_frames") = 0
+        )
         .def("input", &gbe::input)
-        .def("read_memory", &gbe::mem);
+        .def("read_memory", &gbe::mem)
+        .def(
+            "read_memory_range",
+            // count bytes from addr on, into out (a uint8 array of at least count bytes) if given
+            [](gbe &g, uint16_t addr, size_t count, py::object out) {
+                py::array_t<uint8_t, py::array::c_style> arr =
+                    out.is_none() ? py::array_t<uint8_t, py::array::c_style>(count)
+                                  : out.cast<py::array_t<uint8_t, py::array::c_style>>();
+                if (size_t(arr.size()) < count)
+                    throw py::value_error("output buffer is too small");
+                g.read_memory(addr, arr.mutable_data(), count);
+                return arr;
+            },
+            py::arg("addr"), py::arg("count"), py::arg("out") = py::none()
+        )
+        .def(
+            "set_schema",
+            // fields gathered at every vblank, see parse_schema
+            [](gbe &g, const py::list &fields) { g.set_observation_schema(parse_schema(fields)); }
+        )
+        .def(
+            "values",
+            [](gbe &g) {
+                return py::array_t<int32_t>(g.value_count(), g.values());
+            }
+        )
+        .def("reset", &gbe::reset)
+        .def("set_reset_state", &gbe::set_reset_state)
+        .def("state_hash", &gbe::state_hash)
+        .def("state_size", &gbe::state_size)
+        .def(
+            "save_state",
+            // machine state into out (any writable buffer of at least state_size() bytes) if given, else into
+            // a new uint8 array
+            [](gbe &g, py::object out) -> py::object {
+                if (out.is_none()) {
+                    py::array_t<uint8_t> arr(g.state_size());
+                    g.save_state(arr.mutable_data());
+                    return std::move(arr);
+                }
+                py::buffer_info info = out.cast<py::buffer>().request(true);
+                g.save_state(state_buffer(info, g.state_size()));
+                return out;
+            },
+            py::arg("out") = py::none()
+        )
+        .def(
+            "load_state",
+            // restore a state saved by save_state of an instance running the same ROM. A state of the wrong size
+            // or cartridge RAM layout raises ValueError (load_state's std::invalid_argument) and is not loaded.
+            [](gbe &g, py::buffer state) {
+                py::buffer_info info = state.request();
+                if (size_t(info.size * info.itemsize) != g.state_size())
+                    throw py::value_error("state size does not match the ROM");
+                g.load_state(state_buffer(info, g.state_size()));
+            },
+            py::arg("state")
+        )
+        .def(py::pickle(
+            // the ROM path, its hash and the machine state. Step, schema and observation options are not kept.
+            [](const gbe &g) {
+                py::bytes state(nullptr, g.state_size());
+                g.save_state(reinterpret_cast<uint8_t *>(PyBytes_AS_STRING(state.ptr())));
+                return py::make_tuple(g.rom_path(), g.rom_hash(), state);
+            },
+            [](const py::tuple &t) {
+                if (t.size() != 3)
+                    throw py::value_error("invalid GBE pickle");
+                std::unique_ptr<gbe> g(new gbe(t[0].cast<std::string>()));
+                if (g->rom_hash() != t[1].cast<uint64_t>())
+                    throw py::value_error("ROM " + g->rom_path() + " has changed since the state was saved");
+                py::bytes state = t[2].cast<py::bytes>();
+                if (size_t(PyBytes_GET_SIZE(state.ptr())) != g->state_size())
+                    throw py::value_error("invalid GBE pickle");
+                g->load_state(reinterpret_cast<const uint8_t *>(PyBytes_AS_STRING(state.ptr())));
+                return g;
+            }
+        ))
+        .def(
+            "configure_step", &gbe::configure_step, py::arg("max_pool") = false, py::arg("sticky_prob") = 0.0,
+            py::arg("seed") = 0
+        )
+        .def(
+            "step",
+            // hold action (up, down, left, right, a, b, start, select) for repeat frames, returns (observation, done)
+            [](gbe &g, byte_array action, unsigned repeat) {
+                uint8_t buttons = action_mask(action);
+                bool running;
+                {
+                    py::gil_scoped_release release;
+                    running = g.step(buttons, repeat);
+                }
+                return step_result(g, running);
+            },
+            py::arg("action"), py::arg("repeat") = 1
+        )
+        .def(
+            "step_async",
+            // step on a background thread, returns a StepHandle for (observation, done). Don't use the
+            // instance until the step is done.
+            [](py::object self, byte_array action, unsigned repeat) {
+                gbe &g       = self.cast<gbe &>();
+                auto future  = std::make_shared<std::future<bool>>(g.step_async(action_mask(action), repeat));
+                auto running = std::make_shared<bool>(true);
+
+                StepHandle handle{self};
+                handle.is_ready = [future] {
+                    return !future->valid() ||
+                           future->wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                };
+                handle.block = [future, running] {
+                    if (future->valid())
+                        *running = future->get();
+                };
+                handle.result = [&g, running] { return step_result(g, *running); };
+                return handle;
+            },
+            py::arg("action"), py::arg("repeat") = 1
+        )
+        .def(
+            "configure_observation",
+            // observations returned by step(): the crop (top, left, height, width) of the screen, area-averaged
+            // to size (height, width), as gray levels or shade indices, the last stack frames stacked
+            [](gbe &g, py::object crop, py::object size, bool grayscale, unsigned stack) {
+                g.configure_observation(make_pipeline(crop, size, grayscale, stack).get());
+            },
+            py::arg("crop") = py::none(), py::arg("size") = py::none(), py::arg("grayscale") = false,
+            py::arg("stack") = 1
+        )
+        .def("warm_start", &gbe::warm_start, py::arg("idle_frames"), py::arg("cache_dir") = "")
+        .def("track_audio_features", &gbe::track_audio_features)
+        .def(
+            "audio_features",
+            [](gbe &g, py::object out) {
+                // fill the caller's (4, AUDIO_FEATURES_PER_CHANNEL) float32 array if given
+                py::array_t<float, py::array::c_style> arr =
+                    out.is_none() ? py::array_t<float, py::array::c_style>({4u, AUDIO_FEATURES_PER_CHANNEL})
+                                  : out.cast<py::array_t<float, py::array::c_style>>();
+                if (arr.size() != AUDIO_FEATURES)
+                    throw py::value_error("audio feature buffer must hold 16 float32 values");
+                g.audio_features(arr.mutable_data());
+                return arr;
+            },
+            py::arg("out") = py::none()
+        );
+
+    py::class_<StepHandle>(m, "StepHandle")
+        .def("ready", [](StepHandle &h) { return h.is_ready(); })
+        .def("wait", &StepHandle::wait)
+        .def(
+            "__await__",
+            // wait() on the loop's executor, the event loop runs other tasks until the step is done
+            [](py::object self) {
+                py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+                return loop.attr("run_in_executor")(py::none(), self.attr("wait")).attr("__await__")();
+            }
+        );
+
+    py::class_<ServerClient>(m, "GBEServer")
+        .def(py::init<std::string>(), py::arg("name") = "/gbe_server")
+        .def("__len__", [](ServerClient &c) { return c.channel->size(); })
+        .def(
+            "step",
+            // step every environment with its row of actions, returns (screens, values, status) views
+            [](py::object self, byte_array actions, unsigned repeat) {
+                ServerClient &c = self.cast<ServerClient &>();
+                if (actions.ndim() != 2 || size_t(actions.shape(0)) != c.channel->size() ||
+                    size_t(actions.shape(1)) != POOL_BUTTONS)
+                    throw py::value_error("actions must have shape (num_envs, 8)");
+
+                std::vector<uint8_t> buttons(c.channel->size());
+                for (size_t i = 0; i < buttons.size(); ++i) {
+                    const uint8_t *a = actions.data(i, 0);
+                    buttons[i]       = gbe::button_mask(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+                }
+                c.run(SERVER_STEP, py::none(), buttons.data(), repeat);
+
+                return py::make_tuple(
+                    c.view<uint8_t>(self, offsetof(ServerSlot, screen), {LCD_H, LCD_W}),
+                    c.view<int32_t>(self, offsetof(ServerSlot, values), {c.channel->header->value_count}),
+                    c.view<uint32_t>(self, offsetof(ServerSlot, status), {})
+                );
+            },
+            py::arg("actions"), py::arg("repeat") = 1
+        )
+        .def(
+            "reset",
+            [](py::object self, py::object mask) {
+                ServerClient &c = self.cast<ServerClient &>();
+                c.run(SERVER_RESET, mask);
+                return py::make_tuple(
+                    c.view<uint8_t>(self, offsetof(ServerSlot, screen), {LCD_H, LCD_W}),
+                    c.view<int32_t>(self, offsetof(ServerSlot, values), {c.channel->header->value_count})
+                );
+            },
+            py::arg("mask") = py::none()
+        )
+        .def(
+            "save", [](ServerClient &c, py::object mask) { c.run(SERVER_SAVE, mask); }, py::arg("mask") = py::none()
+        )
+        .def(
+            "load", [](ServerClient &c, py::object mask) { c.run(SERVER_LOAD, mask); }, py::arg("mask") = py::none()
+        )
+        .def(
+            "snapshots",
+            // writable (num_envs, state_size) view of the snapshot areas used by save and load
+            [](py::object self) {
+                ServerClient &c = self.cast<ServerClient &>();
+                return c.view<uint8_t>(self, offsetof(ServerSlot, snapshot), {c.channel->header->state_size});
+            }
+        )
+        .def(
+            "status",
+            // per environment SERVER_* status of the last request: 0 ok, 1 stuck, 2 crashed, 3 failed
+            [](py::object self) {
+                return self.cast<ServerClient &>().view<uint32_t>(self, offsetof(ServerSlot, status), {});
+            }
+        );
+
+    py::class_<VecGBE>(m, "VecGBE")
+        .def(
+            py::init<std::string, unsigned, py::list, unsigned>(), py::arg("romfile"), py::arg("num_envs"),
+            py::arg("watch") = py::list(), py::arg("threads") = 0
+        )
+        .def("__len__", [](VecGBE &v) { return v.pool.size(); })
+        .def(
+            "__getitem__",
+            [](VecGBE &v, unsigned i) -> gbe & {
+                if (i >= v.pool.size())
+                    throw py::index_error();
+                return v.pool[i];
+            },
+            py::return_value_policy::reference_internal
+        )
+        .def(
+            "step",
+            // step every instance with its row of actions (up, down, left, right, a, b, start, select),
+            // returns (observations, ram, done)
+            [](VecGBE &v, byte_array actions, unsigned repeat) {
+                if (actions.ndim() != 2 || size_t(actions.shape(0)) != v.pool.size() ||
+                    size_t(actions.shape(1)) != POOL_BUTTONS)
+                    throw py::value_error("actions must have shape (num_envs, 8)");
+
+                const uint8_t *input = actions.data();
+                uint8_t *screens     = v.screens.mutable_data();
+                int32_t *ram         = v.ram.mutable_data();
+                uint8_t *done        = v.done.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    v.pool.step(input, screens, ram, done, repeat);
+                }
+                return py::make_tuple(v.screens, v.ram, v.done);
+            },
+            py::arg("actions"), py::arg("repeat") = 1
+        )
+        .def(
+            "step_async",
+            // start step on the worker threads and return a StepHandle for (observations, ram, done). The
+            // returned arrays are the same as step's, and are only valid once the handle is done.
+            [](py::object self, byte_array actions, unsigned repeat) {
+                VecGBE &v = self.cast<VecGBE &>();
+                if (actions.ndim() != 2 || size_t(actions.shape(0)) != v.pool.size() ||
+                    size_t(actions.shape(1)) != POOL_BUTTONS)
+                    throw py::value_error("actions must have shape (num_envs, 8)");
+
+                // finish a pending step before its input is overwritten
+                {
+                    py::gil_scoped_release release;
+                    v.pool.wait();
+                }
+                v.actions.assign(actions.data(), actions.data() + actions.size());
+
+                GbePool::Completion completion = v.pool.step_async(
+                    v.actions.data(), v.screens.mutable_data(), v.ram.mutable_data(), v.done.mutable_data(), repeat
+                );
+
+                StepHandle handle{self};
+                handle.is_ready = [completion] { return completion.ready(); };
+                handle.block    = [completion] { completion.wait(); };
+                handle.result   = [&v] { return py::object(py::make_tuple(v.screens, v.ram, v.done)); };
+                return handle;
+            },
+            py::arg("actions"), py::arg("repeat") = 1
+        )
+        .def(
+            "configure_observation",
+            // like GBE.configure_observation, the screens array becomes (num_envs,) + observation shape
+            [](VecGBE &v, py::object crop, py::object size, bool grayscale, unsigned stack) {
+                std::unique_ptr<FramePipeline> pipeline = make_pipeline(crop, size, grayscale, stack);
+                v.pool.configure_observation(pipeline.get());
+
+                std::vector<size_t> shape = observation_shape(pipeline.get());
+                shape.insert(shape.begin(), v.pool.size());
+                v.screens = py::array_t<uint8_t>(shape);
+            },
+            py::arg("crop") = py::none(), py::arg("size") = py::none(), py::arg("grayscale") = false,
+            py::arg("stack") = 1
+        )
+        .def(
+            "configure_step",
+            [](VecGBE &v, bool max_pool, double sticky_prob, uint64_t seed) {
+                v.pool.configure_step(max_pool, sticky_prob, seed);
+            },
+            py::arg("max_pool") = false, py::arg("sticky_prob") = 0.0, py::arg("seed") = 0
+        )
+        .def(
+            "reset",
+            // reset all instances, or those where mask is nonzero, returns (screens, ram)
+            [](VecGBE &v, py::object mask) {
+                byte_array storage;
+                const uint8_t *selected = v.mask(mask, storage);
+                uint8_t *screens        = v.screens.mutable_data();
+                int32_t *ram            = v.ram.mutable_data();
+                uint8_t *done           = v.done.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    v.pool.reset(selected, screens, ram);
+                }
+                for (size_t i = 0; i < v.pool.size(); ++i)
+                    if (!selected || selected[i])
+                        done[i] = 0;
+                return py::make_tuple(v.screens, v.ram);
+            },
+            py::arg("mask") = py::none()
+        );
 }
@@ -1,3 +1,4 @@
+#include <functional>
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -5,21 +6,40 @@
 #include <vector>
 #include "gbe.h"
 
-// runs test with output to serial
-bool run_test_rom_serial(std::string rom_path) {
-    std::stringstream serial_out_stream;
-    gbe emu(rom_path, [&](uint8_t b) { serial_out_stream << (char)b; });
-    while (emu.run_to_vblank());
-    std::string output_str = serial_out_stream.str();
-    std::cout << output_str << std::endl;
+#define CYCLES_PER_FRAME   70224L
+#define DEFAULT_MAX_CYCLES (4194304L * 120) // two minutes of emulated time
 
-    return output_str.find("Passed") != std::string::npos;
+// run one frame's worth of cycles at a time until done() returns true, the CPU gets stuck or max_cycles pass
+bool run_test_rom(gbe &emu, long max_cycles, std::function<bool()> done) {
+    for (long cycles = 0; cycles < max_cycles; cycles += CYCLES_PER_FRAME) {
+        if (!emu.run(CYCLES_PER_FRAME))
+            return true;
+        if (done())
+            return true;
+    }
+    std::cerr << "Timed out after " << max_cycles << " cycles" << std::endl;
+    return false;
+}
+
+// runs test with output to serial, stops as soon as the verdict is printed
+bool run_test_rom_serial(std::string rom_path, long max_cycles) {
+    gbe emu(rom_path);
+    emu.capture_serial({"Passed", "Failed"});
+    bool finished = run_test_rom(emu, max_cycles, [&]() { return emu.serial_match() >= 0; });
+    std::cout << emu.serial_output() << std::endl;
+
+    return finished && emu.serial_match() == 0;
 }
 
 // runs test with output to memory
-bool run_test_rom_memory(std::string rom_path) {
+bool run_test_rom_memory(std::string rom_path, long max_cycles) {
     gbe emu(rom_path);
-    while (emu.run_to_vblank());
+    // the test writes the signature at start, then replaces the 0x80 (running) status with its result
+    bool finished = run_test_rom(emu, max_cycles, [&]() {
+        uint8_t result[4];
+        emu.read_memory(0xA000, result, sizeof(result));
+        return result[1] == 0xDE && result[2] == 0xB0 && result[3] == 0x61 && result[0] != 0x80;
+    });
     uint8_t status = emu.mem(0xA000);
     uint8_t chk_1 = emu.mem(0xA001);
     uint8_t chk_2 = emu.mem(0xA002);
@@ -40,7 +60,7 @@ bool run_test_rom_memory(std::string rom_path) {
             memory_out_stream << byte;
         }
         std::cout << memory_out_stream.str() << std::endl;
-        return status == 0;
+        return finished && status == 0;
     } else {
         std::cerr << "Signature BAD: "
                   << std::setfill('0')
@@ -58,12 +78,14 @@ bool run_test_rom_memory(std::string rom_path) {
 
 int main(int argc, char **argv) {
     std::vector<std::string> argList(argv, argv + argc);
-    bool ok;
+    bool ok = false;
+    // optional third argument: cycle limit for the ROM
+    long max_cycles = argList.size() > 3 ? std::stol(argList[3]) : DEFAULT_MAX_CYCLES;
 
     if (argList[1] == "serial") {
-        ok = run_test_rom_serial(argList[2]);
+        ok = run_test_rom_serial(argList[2], max_cycles);
     } else if (argList[1] == "memory") {
-        ok = run_test_rom_memory(argList[2]);
+        ok = run_test_rom_memory(argList[2], max_cycles);
     }
 
     return (ok ? 0 : 1);
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "gbe.h"
+#include "savestate.h"
+#include "state.h"
+
+#define TEST_ROM    "state_test.gb"
+#define BATTERY_ROM "state_test_battery.gb"
+#define BATTERY_SAV "state_test_battery.sav"
+
+// ROM-only cart running: LD SP,0xBEEF; LD (0xDFFF),SP; then forever INC (0xC100); INC (0x8100)
+void write_test_rom() {
+    std::vector<uint8_t> rom(0x8000, 0);
+    const uint8_t program[] = {
+        0x31, 0xEF, 0xBE, // LD SP,0xBEEF
+        0x08, 0xFF, 0xDF, // LD (0xDFFF),SP: the high byte lands on 0xE000, echo of 0xC000
+        0x21, 0x00, 0xC1, // loop: LD HL,0xC100
+        0x34,             // INC (HL)
+        0x21, 0x00, 0x81, // LD HL,0x8100
+        0x34,             // INC (HL)
+        0x18, 0xF6        // JR loop
+    };
+    memcpy(&rom[0x100], program, sizeof(program));
+    std::ofstream(TEST_ROM, std::ios::binary).write(reinterpret_cast<const char *>(rom.data()), rom.size());
+}
+
+bool check(bool ok, const std::string &what) {
+    if (!ok)
+        std::cerr << "FAILED: " << what << std::endl;
+    return ok;
+}
+
+std::vector<uint8_t> snapshot(const gbe &emu) {
+    std::vector<uint8_t> state(emu.state_size());
+    emu.save_state(state.data());
+    return state;
+}
+
+// a word written across the end of WRAM by a fork must unshare and land in the fork's own WRAM
+bool test_fork_word_write() {
+    gbe parent(TEST_ROM);
+    uint8_t low = parent.mem(0xDFFF), high = parent.mem(0xC000);
+
+    gbe *child = parent.fork();
+    child->run(32); // LD SP,nn and LD (nn),SP
+
+    bool ok = check(child->mem(0xDFFF) == 0xEF && child->mem(0xC000) == 0xBE, "fork word write across WRAM end") &&
+              check(parent.mem(0xDFFF) == low && parent.mem(0xC000) == high, "fork word write leaks into parent");
+    delete child;
+    return ok;
+}
+
+bool test_fork_diverge() {
+    gbe parent(TEST_ROM);
+    for (unsigned i = 0; i < 5; ++i)
+        parent.run_to_vblank();
+
+    std::vector<uint8_t> before = snapshot(parent);
+    uint64_t hash               = parent.state_hash();
+
+    gbe *child = parent.fork();
+    bool ok    = check(snapshot(*child) == before, "fork starts in the parent's state");
+    for (unsigned i = 0; i < 30; ++i)
+        child->run_to_vblank();
+
+    ok = ok && check(child->state_hash() != hash, "fork diverges") &&
+         check(snapshot(parent) == before && parent.state_hash() == hash, "parent unchanged by fork");
+    delete child;
+
+    // the parent keeps running on its own memory once the fork is gone
+    parent.run_to_vblank();
+    return ok && check(parent.state_hash() != hash, "parent runs after fork is destroyed");
+}
+
+// pages changed between two snapshots are all reported dirty, and applying the incremental snapshot to the
+// first state gives the second
+bool test_dirty_pages() {
+    gbe emu(TEST_ROM);
+    for (unsigned i = 0; i < 5; ++i)
+        emu.run_to_vblank();
+    std::vector<uint8_t> start = snapshot(emu);
+
+    emu.checkpoint();
+    for (unsigned i = 0; i < 10; ++i)
+        emu.run_to_vblank();
+    std::vector<uint8_t> end = snapshot(emu);
+
+    std::vector<unsigned> changed = emu.diff_pages(start.data(), end.data());
+    std::vector<unsigned> dirty   = emu.dirty_pages();
+    bool ok = check(!changed.empty(), "pages change while running");
+    for (unsigned p : changed)
+        ok = ok && check(std::find(dirty.begin(), dirty.end(), p) != dirty.end(), "changed page reported dirty");
+
+    std::vector<uint8_t> delta(emu.max_dirty_state_size());
+    emu.save_dirty_state(delta.data());
+
+    gbe other(TEST_ROM);
+    other.load_state(start.data());
+    other.load_dirty_state(delta.data());
+    return ok && check(snapshot(other) == end && other.state_hash() == emu.state_hash(), "dirty state round trip");
+}
+
+// the memory hash kept up to date on every write equals one recomputed from scratch, for an instance that
+// wrote through its own memory and for a fork that wrote through shared pages
+bool test_rehash() {
+    gbe emu(TEST_ROM);
+    for (unsigned i = 0; i < 10; ++i)
+        emu.run_to_vblank();
+    gbe *child = emu.fork();
+    for (unsigned i = 0; i < 10; ++i)
+        child->run_to_vblank();
+
+    bool ok = true;
+    for (const gbe *instance : {static_cast<const gbe *>(&emu), static_cast<const gbe *>(child)}) {
+        std::vector<uint8_t> state = snapshot(*instance);
+        MachineState *copy         = MachineState::create(0);
+        memcpy(copy, state.data(), state.size());
+        uint64_t incremental = copy->memory_hash;
+        copy->rehash();
+        ok = ok && check(copy->memory_hash == incremental, "incremental memory hash matches rehash") &&
+             check(copy->hash() == instance->state_hash(), "state hash matches rehashed copy");
+        MachineState::destroy(copy);
+    }
+    delete child;
+    return ok;
+}
+
+std::vector<uint8_t> read_file(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// MBC1 cart with 8 KB battery-backed RAM, the program stores 0x5A at 0xA000 and stops
+void write_battery_rom() {
+    std::vector<uint8_t> rom(0x8000, 0);
+    const uint8_t program[] = {
+        0x3E, 0x0A,       // LD A,0x0A
+        0xEA, 0x00, 0x00, // LD (0x0000),A: enable cart RAM
+        0x3E, 0x5A,       // LD A,0x5A
+        0xEA, 0x00, 0xA0, // LD (0xA000),A
+        0x18, 0xFE        // JR -2
+    };
+    memcpy(&rom[0x100], program, sizeof(program));
+    rom[0x147] = 0x03; // MBC1+RAM+BATTERY
+    rom[0x149] = 0x02; // 8 KB RAM
+    std::ofstream(BATTERY_ROM, std::ios::binary).write(reinterpret_cast<const char *>(rom.data()), rom.size());
+    std::remove(BATTERY_SAV);
+}
+
+// resets and warm starts must not overwrite the mapped save file with the cartridge RAM of their state
+// forking shares the cart RAM banks, the last of which ends the state block when the cart has no clock
+bool test_fork_cart_ram() {
+    write_battery_rom();
+    gbe parent(BATTERY_ROM);
+    parent.run_to_vblank();
+    std::vector<uint8_t> before = snapshot(parent);
+
+    gbe *child = parent.fork();
+    bool ok    = check(snapshot(*child) == before && child->mem(0xA000) == 0x5A, "fork shares cart RAM");
+    child->run_to_vblank();
+    delete child;
+    return ok && check(snapshot(parent) == before, "parent cart RAM unchanged by fork");
+}
+
+bool test_battery_reset() {
+    write_battery_rom();
+    bool ok;
+    {
+        gbe emu(BATTERY_ROM, [](uint8_t) {}, true);
+        emu.run_to_vblank();
+        ok = check(emu.mem(0xA000) == 0x5A, "cart RAM written");
+
+        emu.reset();
+        ok = ok && check(emu.mem(0xA000) == 0x5A, "reset keeps battery-backed cart RAM");
+        emu.warm_start(2);
+        emu.reset();
+        ok = ok && check(emu.mem(0xA000) == 0x5A, "warm start keeps battery-backed cart RAM");
+    }
+    std::vector<uint8_t> sav = read_file(BATTERY_SAV);
+    return ok && check(sav.size() == 0x2000 && sav[0] == 0x5A, "save file keeps cart RAM");
+}
+
+// a state with another cartridge RAM size is rejected and the running state is kept
+bool test_load_state_mismatch() {
+    gbe emu(TEST_ROM);
+    gbe other(BATTERY_ROM);
+    emu.run_to_vblank();
+    other.run_to_vblank();
+    std::vector<uint8_t> before = snapshot(emu);
+    std::vector<uint8_t> state  = snapshot(other);
+
+    bool rejected = false;
+    try {
+        emu.load_state(state.data());
+    } catch (const std::invalid_argument &) {
+        rejected = true;
+    }
+    return check(rejected, "state with other cart RAM size rejected") &&
+           check(snapshot(emu) == before, "rejected state leaves state untouched");
+}
+
+// a state survives encode and decode unchanged, and a corrupted section is rejected without touching the target
+bool test_savestate_round_trip() {
+    gbe emu(TEST_ROM);
+    for (unsigned i = 0; i < 5; ++i)
+        emu.run_to_vblank();
+    std::vector<uint8_t> state = snapshot(emu);
+    std::vector<uint8_t> rom   = read_file(TEST_ROM);
+
+    std::vector<uint8_t> data = SaveState::encode(state.data(), rom.data());
+    MachineState *decoded     = MachineState::create(0);
+    bool ok                   = check(decoded->size() == state.size(), "savestate target size");
+
+    ok = ok && check(SaveState::decode(data, *decoded, rom.data()), "savestate decodes") &&
+         check(!memcmp(decoded, state.data(), state.size()), "savestate round trip");
+
+    // flip a byte in the middle of the file, inside a section's payload
+    std::vector<uint8_t> corrupted = data;
+    corrupted[data.size() / 2] ^= 0xFF;
+    MachineState *target = MachineState::create(0);
+    uint8_t *raw         = reinterpret_cast<uint8_t *>(target);
+    std::vector<uint8_t> before(raw, raw + target->size());
+
+    ok = ok && check(!SaveState::decode(corrupted, *target, rom.data()), "corrupted savestate rejected") &&
+         check(!memcmp(target, before.data(), before.size()), "rejected savestate leaves state untouched");
+
+    MachineState::destroy(decoded);
+    MachineState::destroy(target);
+    return ok;
+}
+
+int main() {
+    write_test_rom();
+
+    bool ok = true;
+    ok      = test_fork_word_write() && ok;
+    ok      = test_fork_diverge() && ok;
+    ok      = test_fork_cart_ram() && ok;
+    ok      = test_dirty_pages() && ok;
+    ok      = test_rehash() && ok;
+    ok      = test_savestate_round_trip() && ok;
+    ok      = test_battery_reset() && ok;
+    ok      = test_load_state_mismatch() && ok;
+
+    std::cout << (ok ? "Passed" : "Failed") << std::endl;
+    return ok ? 0 : 1;
+}